@@ -14,34 +14,32 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/system_properties.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
 #include <linux/kd.h>
 
 #include "log.h"
-
-#ifdef ANDROID
-#include <cutils/memory.h>
-#else
-void android_memset16(void *_ptr, unsigned short val, unsigned count)
-{
-    unsigned short *ptr = _ptr;
-    count >>= 1;
-    while(count--)
-        *ptr++ = val;
-}
-#endif
+#include "../logo/logo_rle.h"
+#include "../logo/logo_anim.h"
 
 struct FB {
-    unsigned short *bits;
-    unsigned size;
+    unsigned char *bits;
+    unsigned size;              /* of one page */
+    unsigned pages;             /* mapped, 1 or 2 */
+    unsigned page;              /* on screen */
     int fd;
     struct fb_fix_screeninfo fi;
     struct fb_var_screeninfo vi;
@@ -49,11 +47,12 @@ struct FB {
 
 #define fb_width(fb) ((fb)->vi.xres)
 #define fb_height(fb) ((fb)->vi.yres)
-#define fb_size(fb) ((fb)->vi.xres * (fb)->vi.yres * 2)
+#define fb_bpp(fb) ((fb)->vi.bits_per_pixel >> 3)
+#define fb_size(fb) ((fb)->size)
 
 static int fb_open(struct FB *fb)
 {
-    fb->fd = open("/dev/graphics/fb0", O_RDWR);
+    fb->fd = open("/dev/graphics/fb0", O_RDWR | O_CLOEXEC);
     if (fb->fd < 0)
         return -1;
 
@@ -61,8 +60,24 @@ static int fb_open(struct FB *fb)
         goto fail;
     if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &fb->vi) < 0)
         goto fail;
+    if (fb_bpp(fb) != 2 && fb_bpp(fb) != 4)
+        goto fail;
+    if (fb->fi.line_length < fb_width(fb) * fb_bpp(fb))
+        goto fail;
+
+    /* the first page, at the framebuffer's real line length and depth */
+    fb->size = fb->fi.line_length * fb_height(fb);
+    if (fb->size > fb->fi.smem_len)
+        goto fail;
 
-    fb->bits = mmap(0, fb_size(fb), PROT_READ | PROT_WRITE, 
+    /* and the second page, if there is one to pan to */
+    fb->pages = 1;
+    if (fb->fi.smem_len / fb->size >= 2 &&
+        fb->vi.yres_virtual >= fb_height(fb) * 2)
+        fb->pages = 2;
+    fb->page = fb->vi.yoffset >= fb_height(fb) && fb->pages == 2;
+
+    fb->bits = mmap(0, fb_size(fb) * fb->pages, PROT_READ | PROT_WRITE,
                     MAP_SHARED, fb->fd, 0);
     if (fb->bits == MAP_FAILED)
         goto fail;
@@ -76,7 +91,7 @@ fail:
 
 static void fb_close(struct FB *fb)
 {
-    munmap(fb->bits, fb_size(fb));
+    munmap(fb->bits, fb_size(fb) * fb->pages);
     close(fb->fd);
 }
 
@@ -89,6 +104,21 @@ static void fb_update(struct FB *fb)
     ioctl(fb->fd, FBIOPUT_VSCREENINFO, &fb->vi);
 }
 
+/*
+ * Put a complete frame on screen: copy it into the page that isn't shown
+ * and pan to that. With a single page the copy goes to the screen, which
+ * can tear, but only for the length of one copy.
+ */
+static void fb_show(struct FB *fb, const unsigned char *frame)
+{
+    unsigned page = fb->pages == 2 ? !fb->page : 0;
+
+    memcpy(fb->bits + page * fb_size(fb), frame, fb_size(fb));
+    fb->vi.yoffset = page * fb_height(fb);
+    if (ioctl(fb->fd, FBIOPAN_DISPLAY, &fb->vi) == 0)
+        fb->page = page;
+}
+
 static int vt_set_mode(int graphics)
 {
     int fd, r;
@@ -100,18 +130,119 @@ static int vt_set_mode(int graphics)
     return r;
 }
 
-#if 0
-/* 565RLE image format: [count(2 bytes), rle(2 bytes)] */
+/*
+ * Animations play on a detached thread of init at the lowest priority,
+ * decoding at most LOGO_ANIM_BUDGET pixels per frame period into a frame
+ * in memory; a frame that needs more is finished over the following
+ * periods and only shown once complete. The thread ends once
+ * bootanimation is running, boot completes or LOGO_ANIM_TIMEOUT passes.
+ */
+#define LOGO_ANIM_BUDGET (64 * 1024)
+#define LOGO_ANIM_TIMEOUT 120
+
+struct logo_player {
+    struct FB fb;
+    struct logo_target t;       /* the frame being decoded */
+    struct logo_anim a;
+    void *data;
+    size_t size;
+};
+
+static int logo_anim_done(void)
+{
+    char value[PROP_VALUE_MAX];
+
+    if (__system_property_get("init.svc.bootanim", value) > 0 &&
+        !strcmp(value, "running"))
+        return 1;
+    if (__system_property_get("sys.boot_completed", value) > 0 &&
+        !strcmp(value, "1"))
+        return 1;
+    return 0;
+}
+
+static void logo_player_free(struct logo_player *p)
+{
+    munmap(p->data, p->size);
+    fb_close(&p->fb);
+    free(p->t.bits);
+    free(p);
+}
+
+static void *logo_anim_play(void *arg)
+{
+    struct logo_player *p = arg;
+    struct logo_anim *a = &p->a;
+    struct timespec next;
+    time_t deadline;
+    unsigned delay = a->hdr->delay_ms ? a->hdr->delay_ms : 1;
+
+    /* on Linux this only lowers this thread, not the rest of init */
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    deadline = next.tv_sec + LOGO_ANIM_TIMEOUT;
+
+    while (!logo_anim_done() && next.tv_sec < deadline) {
+        if (logo_anim_step(a, &p->t, LOGO_ANIM_BUDGET)) {
+            fb_show(&p->fb, p->t.bits);
+            if (a->hdr->frames == 1)
+                break;
+            logo_anim_next(a);
+        }
+
+        next.tv_nsec += (delay % 1000) * 1000000;
+        next.tv_sec += delay / 1000 + next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+    }
+
+    logo_player_free(p);
+    return NULL;
+}
+
+/* Start playing an animation; p is freed by the player. */
+static int logo_anim_start(struct logo_player *p)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    /* the first frame is drawn over a cleared screen */
+    p->t.bits = calloc(1, fb_size(&p->fb));
+    if (p->t.bits == NULL) {
+        logo_player_free(p);
+        return -1;
+    }
 
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, logo_anim_play, p);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        logo_player_free(p);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * RLE image format: [count, pixel] runs, either 16-bit (RGB565) or
+ * 32-bit; see logo_rle.h. The file may instead be a multi-frame
+ * animation; see logo_anim.h.
+ */
 int load_565rle_image(char *fn)
 {
     struct FB fb;
+    struct logo_target t;
+    struct logo_anim a;
+    struct logo_player *p;
     struct stat s;
-    unsigned short *data, *bits, *ptr;
-    unsigned count, max;
-    int fd;
+    void *data;
+    int fd, format;
 
-    if (vt_set_mode(1)) 
+    if (vt_set_mode(1))
         return -1;
 
 #ifndef NO_INITLOGO
@@ -132,21 +263,44 @@ int load_565rle_image(char *fn)
     if (fb_open(&fb))
         goto fail_unmap_data;
 
-    max = fb_width(&fb) * fb_height(&fb);
-    ptr = data;
-    count = s.st_size;
-    bits = fb.bits;
-    while (count > 3) {
-        unsigned n = ptr[0];
-        if (n > max)
-            break;
-        android_memset16(bits, ptr[1], n << 1);
-        bits += n;
-        max -= n;
-        ptr += 2;
-        count -= 4;
+    t.bits = fb.bits;
+    t.width = fb_width(&fb);
+    t.height = fb_height(&fb);
+    t.stride = fb.fi.line_length;
+    t.bpp = fb_bpp(&fb);
+
+    if (logo_anim_is(data, s.st_size)) {
+        if (logo_anim_open(&a, data, s.st_size, &t)) {
+            ERROR("'%s' isn't a %ux%u animation\n", fn, t.width, t.height);
+            fb_close(&fb);
+            goto fail_unmap_data;
+        }
+
+        p = malloc(sizeof(*p));
+        if (p == NULL) {
+            fb_close(&fb);
+            goto fail_unmap_data;
+        }
+        p->fb = fb;
+        p->t = t;
+        p->a = a;
+        p->data = data;
+        p->size = s.st_size;
+
+        /* the player keeps the mappings, so the file can go now */
+        close(fd);
+        unlink(fn);
+        if (logo_anim_start(p)) {
+            ERROR("cannot start animation player\n");
+            return -1;
+        }
+        return 0;
     }
 
+    format = logo_rle_detect(data, s.st_size, &t);
+    if (logo_rle_decode(&t, data, s.st_size, format) < t.width * t.height)
+        ERROR("'%s' doesn't cover the %ux%u screen\n", fn, t.width, t.height);
+
     munmap(data, s.st_size);
     fb_update(&fb);
     fb_close(&fb);
@@ -156,94 +310,10 @@ int load_565rle_image(char *fn)
     return 0;
 
 fail_unmap_data:
-    munmap(data, s.st_size);    
-fail_close_file:
-    close(fd);
-fail_restore_text:
-    vt_set_mode(0);
-    return -1;
-}
-#else
-typedef unsigned int IBUF_TYPE;
-
-static void memset32(void *_ptr, unsigned int val, unsigned count)
-{
-	unsigned int *ptr = _ptr;
-	count >>= 2;
-	while (count--)
-		*ptr++ = val;
-}
-
-/* 565RLE image format: [count(2 bytes), rle(2 bytes)] */
-int load_565rle_image(char *fn)
-{
-	struct FB fb;
-    struct stat s;
-	struct fb_info *info;
-	int fd, count;
-	unsigned max;
-	
-    IBUF_TYPE *data, *bits, *ptr;
-
-	if (vt_set_mode(1)) 
-        return -1;
-
-#ifndef NO_INITLOGO
-	fd = open(fn, O_RDONLY);
-    if (fd < 0) {
-        ERROR("cannot open '%s'\n", fn);
-        goto fail_restore_text;
-    }
-
-    if (fstat(fd, &s) < 0) {
-        goto fail_close_file;
-    }
-    
-	data = mmap(0, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (!data) {
-		goto fail_close_file;
-	}
-	if (read(fd, (char *)data, count) != count) {
-		goto fail_unmap_data;
-	}
-	
-	if (fb_open(&fb))
-        goto fail_unmap_data;
-        
-	max = fb_width(&fb) * fb_height(&fb);
-	ptr = data;
-	bits = (IBUF_TYPE *)(fb.bits);
-
-	while (count > 7)
-	{
-		unsigned n = ptr[0];
-		if (n > max)
-			break;
-			
-		memset32((unsigned int *)bits, ptr[1], n << 2);
-
-		bits += n;
-		max -= n;
-		ptr += 2;
-		count -= 8;
-	}
-	
-	munmap(data, s.st_size);
-	fb_update(&fb);
-    fb_close(&fb);
-    close(fd);
-    unlink(fn);
-#endif
-	return 0;
-	
-fail_unmap_data:
-    munmap(data, s.st_size);    
+    munmap(data, s.st_size);
 fail_close_file:
     close(fd);
 fail_restore_text:
     vt_set_mode(0);
-    
     return -1;
 }
-#endif
-
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Multi-frame boot animation container, decoded incrementally from the
+ * mapped file. All fields are little-endian u32:
+ *
+ *   header:  magic "RLEA", version, width, height, frame count,
+ *            frame delay in ms, loop frame (where playback restarts)
+ *   index:   frame count x { offset, size } in bytes from file start
+ *   frames:  a stream of ops, each a u32 whose top two bits give the
+ *            kind and low 30 bits a pixel count n:
+ *
+ *     LOGO_OP_SKIP  n pixels are the same as in the previous frame
+ *     LOGO_OP_RUN   followed by one pixel, repeated n times
+ *     LOGO_OP_COPY  followed by n literal pixels
+ *
+ * Pixels use the 32-bit RLE byte order R, G, B, X (see logo_rle.h). The
+ * first frame is drawn over a cleared screen, so it should cover
+ * everything; later frames only carry what changed. The frame looped
+ * back to must therefore be a delta from the last frame.
+ *
+ * logo_anim_step decodes at most a given number of pixels per call, so a
+ * player can bound the work done per tick and finish a frame over several
+ * ticks when it has to.
+ */
+
+#ifndef _LOGO_ANIM_H
+#define _LOGO_ANIM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "logo_rle.h"
+
+#define LOGO_ANIM_MAGIC 0x41454c52      /* "RLEA" */
+#define LOGO_ANIM_VERSION 1
+
+#define LOGO_OP_SKIP 0
+#define LOGO_OP_RUN 1
+#define LOGO_OP_COPY 2
+#define LOGO_OP_SHIFT 30
+#define LOGO_OP_COUNT 0x3fffffff
+
+struct logo_anim_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t frames;
+    uint32_t delay_ms;
+    uint32_t loop;
+};
+
+struct logo_anim {
+    const struct logo_anim_header *hdr;
+    const uint32_t *index;
+    unsigned frame;
+    const uint32_t *op;         /* next unread word of the frame */
+    const uint32_t *end;
+    uint32_t kind;              /* op in progress, if left > 0 */
+    uint32_t pixel;
+    unsigned left;
+    unsigned x, y;
+};
+
+static inline int logo_anim_is(const void *data, size_t size)
+{
+    const struct logo_anim_header *h = data;
+
+    return size >= sizeof(*h) && h->magic == LOGO_ANIM_MAGIC;
+}
+
+/* Start decoding frame n. */
+static inline void logo_anim_seek(struct logo_anim *a, unsigned n)
+{
+    const uint8_t *base = (const uint8_t *) a->hdr;
+
+    a->frame = n;
+    a->op = (const uint32_t *) (base + a->index[n * 2]);
+    a->end = (const uint32_t *) (base + a->index[n * 2] + a->index[n * 2 + 1]);
+    a->left = 0;
+    a->x = 0;
+    a->y = 0;
+}
+
+/*
+ * Check the header and frame index against the file and the screen.
+ * Returns 0 and positions a at frame 0, or -1 if the container is bad.
+ */
+static inline int logo_anim_open(struct logo_anim *a, const void *data,
+                                 size_t size, const struct logo_target *t)
+{
+    const struct logo_anim_header *h = data;
+    unsigned i;
+
+    if (!logo_anim_is(data, size) || h->version != LOGO_ANIM_VERSION)
+        return -1;
+    if (h->width != t->width || h->height != t->height)
+        return -1;
+    if (h->frames == 0 || h->loop >= h->frames)
+        return -1;
+    if (h->frames > (size - sizeof(*h)) / 8)
+        return -1;
+
+    a->hdr = h;
+    a->index = (const uint32_t *) (h + 1);
+    for (i = 0; i < h->frames; i++) {
+        uint32_t offset = a->index[i * 2], len = a->index[i * 2 + 1];
+        if (offset % 4 || len % 4 || offset > size || len > size - offset)
+            return -1;
+    }
+
+    logo_anim_seek(a, 0);
+    return 0;
+}
+
+/* Put n pixels of kind at the current position; src is used by COPY. */
+static inline void logo_anim_put(struct logo_anim *a,
+                                 const struct logo_target *t,
+                                 const uint32_t *src, unsigned n)
+{
+    while (n > 0 && a->y < t->height) {
+        unsigned len = t->width - a->x;
+        unsigned char *line = t->bits + a->y * t->stride + a->x * t->bpp;
+        unsigned i;
+
+        if (len > n)
+            len = n;
+
+        if (a->kind == LOGO_OP_RUN) {
+            logo_run(t, &a->x, &a->y, a->pixel, len);
+        } else {
+            if (a->kind == LOGO_OP_COPY) {
+                if (t->bpp == 4) {
+                    memcpy(line, src, len * 4);
+                } else {
+                    uint16_t *p = (uint16_t *) line;
+                    for (i = 0; i < len; i++) {
+                        const unsigned char *c = (const unsigned char *) &src[i];
+                        p[i] = logo_pixel(t, c[0], c[1], c[2]);
+                    }
+                }
+                src += len;
+            }
+            a->x += len;
+            if (a->x == t->width) {
+                a->x = 0;
+                a->y++;
+            }
+        }
+        n -= len;
+    }
+}
+
+/*
+ * Decode up to budget pixels of the current frame onto t.
+ * Returns 1 once the frame is complete, 0 if there is more to do.
+ */
+static inline int logo_anim_step(struct logo_anim *a,
+                                 const struct logo_target *t,
+                                 unsigned budget)
+{
+    while (budget > 0) {
+        unsigned n;
+
+        if (a->left == 0) {
+            if (a->op >= a->end || a->y >= t->height)
+                return 1;
+
+            a->kind = *a->op >> LOGO_OP_SHIFT;
+            a->left = *a->op & LOGO_OP_COUNT;
+            a->op++;
+
+            if (a->kind == LOGO_OP_RUN) {
+                const unsigned char *c = (const unsigned char *) a->op;
+                if (a->op >= a->end)
+                    return 1;
+                a->pixel = t->bpp == 4 ? *a->op :
+                           logo_pixel(t, c[0], c[1], c[2]);
+                a->op++;
+            } else if (a->kind == LOGO_OP_COPY) {
+                /* a literal can't run past the end of its frame */
+                if (a->left > (unsigned) (a->end - a->op))
+                    a->left = a->end - a->op;
+            } else if (a->kind != LOGO_OP_SKIP) {
+                return 1;
+            }
+            budget--;
+            continue;
+        }
+
+        /* skips only move the position, so they don't count */
+        n = a->kind == LOGO_OP_SKIP || a->left < budget ? a->left : budget;
+        logo_anim_put(a, t, a->op, n);
+        if (a->kind == LOGO_OP_COPY)
+            a->op += n;
+        if (a->kind != LOGO_OP_SKIP)
+            budget -= n;
+        a->left -= n;
+    }
+
+    return 0;
+}
+
+/* Move on to the frame after the current one, looping as the header says. */
+static inline void logo_anim_next(struct logo_anim *a)
+{
+    unsigned n = a->frame + 1;
+
+    logo_anim_seek(a, n < a->hdr->frames ? n : a->hdr->loop);
+}
+
+#endif /* _LOGO_ANIM_H */
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * RLE boot logo decoder, shared by init/logo.c and logo/logo.c.
+ *
+ * An image is a plain sequence of [count, pixel] runs covering the screen
+ * row by row, in one of two layouts:
+ *
+ *   LOGO_RLE_16: u16 count, u16 RGB565 pixel
+ *   LOGO_RLE_32: u32 count, u32 pixel stored as the bytes R, G, B, X
+ *
+ * Runs are decoded straight from the mapped file into a framebuffer of
+ * either depth, honouring its line length. A 32-bit framebuffer is
+ * written in the same R, G, B, X byte order as the 32-bit images (the
+ * msm fb driver's channel offsets don't describe its memory layout), a
+ * 16-bit one as RGB565. Runs that would overflow the screen are clipped.
+ */
+
+#ifndef _LOGO_RLE_H
+#define _LOGO_RLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#define LOGO_RLE_16 2
+#define LOGO_RLE_32 4
+
+struct logo_target {
+    unsigned char *bits;
+    unsigned width;
+    unsigned height;
+    unsigned stride;            /* bytes per line */
+    unsigned bpp;               /* bytes per pixel, 2 or 4 */
+};
+
+static inline void logo_fill16(uint16_t *p, uint16_t v, unsigned n)
+{
+#ifdef __ARM_NEON__
+    uint16x8_t q = vdupq_n_u16(v);
+    for (; n >= 16; n -= 16, p += 16) {
+        vst1q_u16(p, q);
+        vst1q_u16(p + 8, q);
+    }
+#endif
+    while (n--)
+        *p++ = v;
+}
+
+static inline void logo_fill32(uint32_t *p, uint32_t v, unsigned n)
+{
+#ifdef __ARM_NEON__
+    uint32x4_t q = vdupq_n_u32(v);
+    for (; n >= 8; n -= 8, p += 8) {
+        vst1q_u32(p, q);
+        vst1q_u32(p + 4, q);
+    }
+#endif
+    while (n--)
+        *p++ = v;
+}
+
+/* Convert 8-bit r, g, b to the framebuffer's pixel layout. */
+static inline uint32_t logo_pixel(const struct logo_target *t,
+                                  unsigned r, unsigned g, unsigned b)
+{
+    uint32_t v;
+    unsigned char *c = (unsigned char *) &v;
+
+    if (t->bpp == 2)
+        return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+
+    c[0] = r;
+    c[1] = g;
+    c[2] = b;
+    c[3] = 0xff;
+    return v;
+}
+
+/* Total pixels covered by the runs if data is read in the given layout,
+ * or (uint64_t) -1 if the size doesn't fit the layout. */
+static inline uint64_t logo_rle_pixels(const void *data, size_t size,
+                                       int format)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    if (format == LOGO_RLE_32) {
+        const uint32_t *p = data;
+        if (size % 8)
+            return (uint64_t) -1;
+        for (i = 0; i < size / 4; i += 2)
+            total += p[i];
+    } else {
+        const uint16_t *p = data;
+        if (size % 4)
+            return (uint64_t) -1;
+        for (i = 0; i < size / 2; i += 2)
+            total += p[i];
+    }
+    return total;
+}
+
+/*
+ * The files carry no header, so pick the layout whose runs add up to
+ * exactly one screen. If neither does, assume the one matching the
+ * framebuffer depth and let the decoder clip.
+ */
+static inline int logo_rle_detect(const void *data, size_t size,
+                                  const struct logo_target *t)
+{
+    uint64_t pixels = (uint64_t) t->width * t->height;
+
+    if (logo_rle_pixels(data, size, LOGO_RLE_32) == pixels)
+        return LOGO_RLE_32;
+    if (logo_rle_pixels(data, size, LOGO_RLE_16) == pixels)
+        return LOGO_RLE_16;
+    return t->bpp == 4 ? LOGO_RLE_32 : LOGO_RLE_16;
+}
+
+/* Fill n pixels starting at (*x, *y), wrapping at the end of each line. */
+static inline void logo_run(const struct logo_target *t, unsigned *x,
+                            unsigned *y, uint32_t v, unsigned n)
+{
+    while (n > 0 && *y < t->height) {
+        unsigned char *line = t->bits + *y * t->stride + *x * t->bpp;
+        unsigned len = t->width - *x;
+
+        if (len > n)
+            len = n;
+        if (t->bpp == 4)
+            logo_fill32((uint32_t *) line, v, len);
+        else
+            logo_fill16((uint16_t *) line, v, len);
+
+        n -= len;
+        *x += len;
+        if (*x == t->width) {
+            *x = 0;
+            (*y)++;
+        }
+    }
+}
+
+/*
+ * Decode size bytes of RLE data onto the target.
+ * Returns the number of pixels written.
+ */
+static inline unsigned logo_rle_decode(const struct logo_target *t,
+                                       const void *data, size_t size,
+                                       int format)
+{
+    unsigned x = 0, y = 0, left = t->width * t->height;
+    size_t i;
+
+    if (format == LOGO_RLE_32) {
+        const uint32_t *p = data;
+        for (i = 0; i + 2 <= size / 4 && left > 0; i += 2) {
+            const unsigned char *c = (const unsigned char *) &p[i + 1];
+            unsigned n = p[i] < left ? p[i] : left;
+            uint32_t v = t->bpp == 4 ? p[i + 1] : logo_pixel(t, c[0], c[1], c[2]);
+            logo_run(t, &x, &y, v, n);
+            left -= n;
+        }
+    } else {
+        const uint16_t *p = data;
+        for (i = 0; i + 2 <= size / 2 && left > 0; i += 2) {
+            unsigned v = p[i + 1];
+            unsigned r = (v >> 11) & 0x1f, g = (v >> 5) & 0x3f, b = v & 0x1f;
+            unsigned n = p[i] < left ? p[i] : left;
+            if (t->bpp == 4)
+                v = logo_pixel(t, (r << 3) | (r >> 2), (g << 2) | (g >> 4),
+                               (b << 3) | (b >> 2));
+            logo_run(t, &x, &y, v, n);
+            left -= n;
+        }
+    }
+
+    return t->width * t->height - left;
+}
+
+#endif /* _LOGO_RLE_H */
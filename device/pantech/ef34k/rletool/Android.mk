@@ -0,0 +1,15 @@
+LOCAL_PATH := $(call my-dir)
+
+# rletool: encodes PNGs into the boot logo RLE formats and back
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := rletool.c
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/../patch/system/core/logo \
+    external/libpng \
+    external/zlib
+LOCAL_STATIC_LIBRARIES := libpng libz
+LOCAL_MODULE := rletool
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,578 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Converts PNGs to the boot logo formats read by load_565rle_image and
+ * back. Every encoded image is decoded again with the decoder init uses
+ * (logo_rle.h, logo_anim.h) and compared before it is written.
+ *
+ *   rletool encode [-16|-32] in.png out.rle
+ *   rletool decode width in.rle out.png
+ *   rletool anim [-d delay_ms] [-l loop] out.rlea in.png...
+ *   rletool frames in.rlea out-     (writes out-000.png, out-001.png, ...)
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <png.h>
+
+#include "logo_rle.h"
+#include "logo_anim.h"
+
+#define RLE16_MAX 0xffff
+
+struct image {
+    unsigned width;
+    unsigned height;
+    uint32_t *pixels;           /* bytes R, G, B, 0 */
+};
+
+struct buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+static void die(const char *fmt, const char *arg)
+{
+    fprintf(stderr, "rletool: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void buf_put(struct buf *b, const void *p, size_t n)
+{
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2;
+        b->data = realloc(b->data, b->cap);
+        if (b->data == NULL)
+            die("%s", strerror(ENOMEM));
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void buf_put32(struct buf *b, uint32_t v)
+{
+    buf_put(b, &v, 4);
+}
+
+static uint32_t make_pixel(unsigned r, unsigned g, unsigned b)
+{
+    uint32_t v = 0;
+    unsigned char *c = (unsigned char *) &v;
+
+    c[0] = r;
+    c[1] = g;
+    c[2] = b;
+    return v;
+}
+
+static void write_file(const char *fn, const void *data, size_t len)
+{
+    FILE *f = fopen(fn, "wb");
+
+    if (f == NULL || fwrite(data, 1, len, f) != len || fclose(f))
+        die("cannot write '%s'", fn);
+}
+
+static void *read_file(const char *fn, size_t *len)
+{
+    FILE *f = fopen(fn, "rb");
+    struct stat s;
+    void *data;
+
+    if (f == NULL || fstat(fileno(f), &s) < 0)
+        die("cannot open '%s'", fn);
+    data = malloc(s.st_size ? s.st_size : 1);
+    if (data == NULL || fread(data, 1, s.st_size, f) != (size_t) s.st_size)
+        die("cannot read '%s'", fn);
+    fclose(f);
+    *len = s.st_size;
+    return data;
+}
+
+/* Any PNG, flattened onto black as 8-bit RGB. */
+static void load_png(const char *fn, struct image *img)
+{
+    png_structp png;
+    png_infop info;
+    png_bytep row;
+    unsigned x, y, channels;
+    FILE *f;
+
+    f = fopen(fn, "rb");
+    if (f == NULL)
+        die("cannot open '%s'", fn);
+
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png_create_info_struct(png);
+    if (png == NULL || info == NULL || setjmp(png_jmpbuf(png)))
+        die("'%s' is not a readable PNG", fn);
+
+    png_init_io(png, f);
+    png_read_info(png, info);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_read_update_info(png, info);
+
+    img->width = png_get_image_width(png, info);
+    img->height = png_get_image_height(png, info);
+    channels = png_get_channels(png, info);
+    img->pixels = malloc(img->width * img->height * 4);
+    row = malloc(png_get_rowbytes(png, info));
+    if (img->pixels == NULL || row == NULL)
+        die("%s", strerror(ENOMEM));
+
+    for (y = 0; y < img->height; y++) {
+        png_read_row(png, row, NULL);
+        for (x = 0; x < img->width; x++) {
+            png_bytep p = row + x * channels;
+            unsigned a = channels == 4 ? p[3] : 255;
+            img->pixels[y * img->width + x] =
+                make_pixel(p[0] * a / 255, p[1] * a / 255, p[2] * a / 255);
+        }
+    }
+
+    free(row);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(f);
+}
+
+static void save_png(const char *fn, const uint8_t *bits, unsigned width,
+                     unsigned height, unsigned stride)
+{
+    png_structp png;
+    png_infop info;
+    png_bytep row;
+    unsigned x, y;
+    FILE *f;
+
+    f = fopen(fn, "wb");
+    if (f == NULL)
+        die("cannot write '%s'", fn);
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png_create_info_struct(png);
+    if (png == NULL || info == NULL || setjmp(png_jmpbuf(png)))
+        die("cannot write '%s'", fn);
+
+    png_init_io(png, f);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    row = malloc(width * 3);
+    for (y = 0; y < height; y++) {
+        const uint8_t *p = bits + y * stride;
+        for (x = 0; x < width; x++, p += 4) {
+            row[x * 3] = p[0];
+            row[x * 3 + 1] = p[1];
+            row[x * 3 + 2] = p[2];
+        }
+        png_write_row(png, row);
+    }
+    png_write_end(png, info);
+
+    free(row);
+    png_destroy_write_struct(&png, &info);
+    fclose(f);
+}
+
+static uint16_t to_565(uint32_t v)
+{
+    const unsigned char *c = (const unsigned char *) &v;
+
+    return ((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3);
+}
+
+/*
+ * One run per stretch of equal pixels, which is the smallest encoding
+ * the format allows. In 16-bit, pixels are compared after reduction to
+ * RGB565, so colours that only differ below that precision merge too.
+ */
+static void encode_rle(const struct image *img, int format, struct buf *out)
+{
+    unsigned i, n, total = img->width * img->height;
+
+    for (i = 0; i < total; i += n) {
+        if (format == LOGO_RLE_16) {
+            uint16_t v = to_565(img->pixels[i]), run[2];
+            for (n = 1; i + n < total && n < RLE16_MAX &&
+                        to_565(img->pixels[i + n]) == v; n++)
+                ;
+            run[0] = n;
+            run[1] = v;
+            buf_put(out, run, sizeof(run));
+        } else {
+            uint32_t v = img->pixels[i];
+            for (n = 1; i + n < total && img->pixels[i + n] == v; n++)
+                ;
+            buf_put32(out, n);
+            buf_put32(out, v);
+        }
+    }
+}
+
+/* What init would show for img at the given depth, as R, G, B, X. */
+static uint32_t expected(const struct image *img, unsigned i, int format)
+{
+    uint16_t v;
+    unsigned r, g, b;
+
+    if (format == LOGO_RLE_32)
+        return img->pixels[i];
+
+    v = to_565(img->pixels[i]);
+    r = (v >> 11) & 0x1f;
+    g = (v >> 5) & 0x3f;
+    b = v & 0x1f;
+    return make_pixel((r << 3) | (r >> 2), (g << 2) | (g >> 4),
+                      (b << 3) | (b >> 2));
+}
+
+static void verify_rle(const struct image *img, const struct buf *rle,
+                       int format)
+{
+    struct logo_target t;
+    unsigned i;
+
+    t.width = img->width;
+    t.height = img->height;
+    t.bpp = 4;
+    t.stride = img->width * 4;
+    t.bits = calloc(img->width * img->height, 4);
+
+    if (logo_rle_detect(rle->data, rle->len, &t) != format)
+        die("%s", "encoded image would be read in the wrong format");
+    if (logo_rle_decode(&t, rle->data, rle->len, format) !=
+        img->width * img->height)
+        die("%s", "encoded image doesn't cover the screen");
+
+    for (i = 0; i < img->width * img->height; i++) {
+        uint32_t got = ((uint32_t *) t.bits)[i], want = expected(img, i, format);
+        /* the decoder sets the X byte for 16-bit sources */
+        if ((got & 0x00ffffff) != (want & 0x00ffffff))
+            die("%s", "decoded image differs from the source");
+    }
+    free(t.bits);
+}
+
+static int cmd_encode(int argc, char **argv)
+{
+    struct image img;
+    struct buf rle[2];
+    int i, format = LOGO_RLE_32;
+    size_t raw;
+
+    if (argc == 4 && (!strcmp(argv[1], "-16") || !strcmp(argv[1], "-32"))) {
+        format = !strcmp(argv[1], "-16") ? LOGO_RLE_16 : LOGO_RLE_32;
+        argc--;
+        argv++;
+    }
+    if (argc != 3)
+        return -1;
+
+    load_png(argv[1], &img);
+    memset(rle, 0, sizeof(rle));
+    encode_rle(&img, LOGO_RLE_16, &rle[0]);
+    encode_rle(&img, LOGO_RLE_32, &rle[1]);
+    verify_rle(&img, &rle[0], LOGO_RLE_16);
+    verify_rle(&img, &rle[1], LOGO_RLE_32);
+
+    raw = (size_t) img.width * img.height;
+    printf("%s: %ux%u\n", argv[1], img.width, img.height);
+    for (i = 0; i < 2; i++) {
+        int bpp = i ? 4 : 2;
+        printf("  %d-bit rle %8zu bytes (%5.1f%% of raw %zu)%s\n", bpp * 8,
+               rle[i].len, 100.0 * rle[i].len / (raw * bpp), raw * bpp,
+               format == (i ? LOGO_RLE_32 : LOGO_RLE_16) ? ", written" : "");
+    }
+
+    i = format == LOGO_RLE_32;
+    write_file(argv[2], rle[i].data, rle[i].len);
+    return 0;
+}
+
+static int cmd_decode(int argc, char **argv)
+{
+    struct logo_target t;
+    uint64_t pixels;
+    size_t len;
+    void *data;
+    int format;
+
+    if (argc != 4 || atoi(argv[1]) <= 0)
+        return -1;
+
+    data = read_file(argv[2], &len);
+    t.width = atoi(argv[1]);
+    t.bpp = 4;
+    t.stride = t.width * 4;
+
+    /* the files carry no size: take the layout that fills whole lines */
+    pixels = logo_rle_pixels(data, len, LOGO_RLE_32);
+    format = LOGO_RLE_32;
+    if (pixels == (uint64_t) -1 || pixels % t.width || pixels > (1 << 26)) {
+        pixels = logo_rle_pixels(data, len, LOGO_RLE_16);
+        format = LOGO_RLE_16;
+    }
+    if (pixels == (uint64_t) -1 || pixels % t.width || pixels > (1 << 26))
+        die("'%s' is not an RLE image of that width", argv[2]);
+
+    t.height = pixels / t.width;
+    t.bits = calloc(t.height, t.stride);
+    logo_rle_decode(&t, data, len, format);
+
+    printf("%s: %d-bit rle, %ux%u\n", argv[2], format * 8, t.width, t.height);
+    save_png(argv[3], t.bits, t.width, t.height, t.stride);
+    return 0;
+}
+
+static void put_op(struct buf *b, unsigned kind, unsigned n)
+{
+    buf_put32(b, (kind << LOGO_OP_SHIFT) | n);
+}
+
+static int unchanged(const struct image *cur, const struct image **prev,
+                     int nprev, unsigned i)
+{
+    int k;
+
+    if (nprev == 0)
+        return 0;
+    for (k = 0; k < nprev; k++) {
+        if (prev[k]->pixels[i] != cur->pixels[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Ops for cur, skipping pixels that are unchanged in every frame in prev
+ * (none for a key frame). Changed pixels go out as RUN when at least two
+ * repeat and as COPY literals otherwise.
+ */
+static void encode_frame(const struct image *cur, const struct image **prev,
+                         int nprev, struct buf *out)
+{
+    unsigned i = 0, total = cur->width * cur->height;
+
+    while (i < total) {
+        unsigned n = 1;
+
+        if (unchanged(cur, prev, nprev, i)) {
+            while (i + n < total && n < LOGO_OP_COUNT && unchanged(cur, prev, nprev, i + n))
+                n++;
+            put_op(out, LOGO_OP_SKIP, n);
+        } else {
+            while (i + n < total && n < LOGO_OP_COUNT &&
+                   cur->pixels[i + n] == cur->pixels[i])
+                n++;
+            if (n >= 2) {
+                put_op(out, LOGO_OP_RUN, n);
+                buf_put32(out, cur->pixels[i]);
+            } else {
+                /* a literal ends where a skip or a run of 3 begins */
+                while (i + n < total && n < LOGO_OP_COUNT && !unchanged(cur, prev, nprev, i + n) &&
+                       !(i + n + 2 < total &&
+                         cur->pixels[i + n] == cur->pixels[i + n + 1] &&
+                         cur->pixels[i + n] == cur->pixels[i + n + 2]))
+                    n++;
+                put_op(out, LOGO_OP_COPY, n);
+                buf_put(out, cur->pixels + i, n * 4);
+            }
+        }
+        i += n;
+    }
+}
+
+static void verify_anim(const struct buf *out, const struct image *frames,
+                        unsigned count, unsigned loop)
+{
+    struct logo_target t;
+    struct logo_anim a;
+    unsigned i;
+
+    t.width = frames[0].width;
+    t.height = frames[0].height;
+    t.bpp = 4;
+    t.stride = t.width * 4;
+    t.bits = calloc(t.height, t.stride);
+
+    if (logo_anim_open(&a, out->data, out->len, &t))
+        die("%s", "encoded animation is rejected by the decoder");
+
+    /* play through once and then the looped part again */
+    for (i = 0; i < count + count - loop; i++) {
+        const struct image *want = &frames[i < count ? i : loop + i - count];
+        while (!logo_anim_step(&a, &t, LOGO_OP_COUNT))
+            ;
+        if (memcmp(t.bits, want->pixels, t.height * t.stride))
+            die("%s", "decoded animation differs from the source");
+        logo_anim_next(&a);
+    }
+    free(t.bits);
+}
+
+static int cmd_anim(int argc, char **argv)
+{
+    struct logo_anim_header h;
+    struct image *frames;
+    struct buf *ops, out;
+    unsigned delay = 40, loop = 0, offset;
+    size_t raw;
+    int i, count;
+
+    for (argc--, argv++; argc >= 2 && argv[0][0] == '-'; argc -= 2, argv += 2) {
+        if (!strcmp(argv[0], "-d"))
+            delay = atoi(argv[1]);
+        else if (!strcmp(argv[0], "-l"))
+            loop = atoi(argv[1]);
+        else
+            return -1;
+    }
+    if (argc < 2)
+        return -1;
+
+    count = argc - 1;
+    if (loop >= (unsigned) count)
+        die("%s", "loop frame is past the last frame");
+
+    frames = calloc(count, sizeof(*frames));
+    ops = calloc(count, sizeof(*ops));
+    for (i = 0; i < count; i++) {
+        load_png(argv[i + 1], &frames[i]);
+        if (frames[i].width != frames[0].width ||
+            frames[i].height != frames[0].height)
+            die("'%s' differs in size from the first frame", argv[i + 1]);
+    }
+
+    for (i = 0; i < count; i++) {
+        const struct image *prev[2];
+        int nprev = 0;
+
+        /* frame 0 is drawn over a cleared screen and never skips; the loop
+         * frame follows both its predecessor and the last frame */
+        if (i > 0)
+            prev[nprev++] = &frames[i - 1];
+        if (i > 0 && i == (int) loop)
+            prev[nprev++] = &frames[count - 1];
+        encode_frame(&frames[i], prev, nprev, &ops[i]);
+    }
+
+    memset(&out, 0, sizeof(out));
+    h.magic = LOGO_ANIM_MAGIC;
+    h.version = LOGO_ANIM_VERSION;
+    h.width = frames[0].width;
+    h.height = frames[0].height;
+    h.frames = count;
+    h.delay_ms = delay;
+    h.loop = loop;
+    buf_put(&out, &h, sizeof(h));
+
+    offset = sizeof(h) + count * 8;
+    for (i = 0; i < count; i++) {
+        buf_put32(&out, offset);
+        buf_put32(&out, ops[i].len);
+        offset += ops[i].len;
+    }
+    for (i = 0; i < count; i++)
+        buf_put(&out, ops[i].data, ops[i].len);
+
+    verify_anim(&out, frames, count, loop);
+
+    raw = (size_t) h.width * h.height * 4 * count;
+    printf("%d frames %ux%u, %u ms, loop at %u: %zu bytes (%.1f%% of raw %zu)\n",
+           count, h.width, h.height, delay, loop, out.len,
+           100.0 * out.len / raw, raw);
+    write_file(argv[0], out.data, out.len);
+    return 0;
+}
+
+static int cmd_frames(int argc, char **argv)
+{
+    struct logo_target t;
+    struct logo_anim a;
+    const struct logo_anim_header *h;
+    char fn[PATH_MAX];
+    size_t len;
+    void *data;
+    unsigned i;
+
+    if (argc != 3)
+        return -1;
+
+    data = read_file(argv[1], &len);
+    h = data;
+    if (!logo_anim_is(data, len))
+        die("'%s' is not an animation", argv[1]);
+
+    t.width = h->width;
+    t.height = h->height;
+    t.bpp = 4;
+    t.stride = t.width * 4;
+    if (t.width == 0 || t.height == 0 || t.width > 8192 || t.height > 8192)
+        die("'%s' has a bad header", argv[1]);
+    t.bits = calloc(t.height, t.stride);
+    if (logo_anim_open(&a, data, len, &t))
+        die("'%s' has a bad header or frame index", argv[1]);
+
+    printf("%s: %u frames %ux%u, %u ms, loop at %u\n", argv[1], h->frames,
+           h->width, h->height, h->delay_ms, h->loop);
+    for (i = 0; i < h->frames; i++) {
+        while (!logo_anim_step(&a, &t, LOGO_OP_COUNT))
+            ;
+        snprintf(fn, sizeof(fn), "%s%03u.png", argv[2], i);
+        save_png(fn, t.bits, t.width, t.height, t.stride);
+        logo_anim_next(&a);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int ret = -1;
+
+    if (argc >= 2) {
+        if (!strcmp(argv[1], "encode"))
+            ret = cmd_encode(argc - 1, argv + 1);
+        else if (!strcmp(argv[1], "decode"))
+            ret = cmd_decode(argc - 1, argv + 1);
+        else if (!strcmp(argv[1], "anim"))
+            ret = cmd_anim(argc - 1, argv + 1);
+        else if (!strcmp(argv[1], "frames"))
+            ret = cmd_frames(argc - 1, argv + 1);
+    }
+
+    if (ret < 0) {
+        fprintf(stderr,
+                "usage: rletool encode [-16|-32] in.png out.rle\n"
+                "       rletool decode width in.rle out.png\n"
+                "       rletool anim [-d delay_ms] [-l loop] out.rlea in.png...\n"
+                "       rletool frames in.rlea out-prefix\n");
+        return 1;
+    }
+    return 0;
+}
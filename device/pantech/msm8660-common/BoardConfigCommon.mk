@@ -58,7 +58,9 @@ TARGET_QCOM_DISPLAY_VARIANT := legacy
 
 # Recovery
 TARGET_RECOVERY_PIXEL_FORMAT := "RGBX_8888"
-BOARD_CUSTOM_GRAPHICS := ../../../device/pantech/msm8660-common/recovery/graphics.c
+# graphics_soft.c is graphics.c drawing fills, text and blits with the NEON
+# kernels in recovery/gr_soft.h; point this at graphics.c to use pixelflinger
+BOARD_CUSTOM_GRAPHICS := ../../../device/pantech/msm8660-common/recovery/graphics_soft.c
 
 # Bluetooth
 BOARD_HAVE_BLUETOOTH := true
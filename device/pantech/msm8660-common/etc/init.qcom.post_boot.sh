@@ -95,7 +95,7 @@ esac
 # Post-setup services
 case "$target" in
     "msm8660" )
-        start mpdecision
+        # cpu1 hotplug is owned by the power HAL; mpdecision stays stopped
         start thermald
     ;;
 esac
@@ -15,13 +15,21 @@
  * limitations under the License.
  */
 #include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #define LOG_TAG "CM PowerHAL"
 #include <utils/Log.h>
+#include <cutils/atomic.h>
 
 #include <hardware/hardware.h>
 #include <hardware/power.h>
@@ -33,15 +41,84 @@
 #define SAMPLING_RATE_SCREEN_OFF "500000"
 #define TIMER_RATE_SCREEN_ON "30000"
 #define TIMER_RATE_SCREEN_OFF "500000"
+#define GOVERNOR_POLL_MS 5000
+
+/*
+ * Second core hotplug. cpu1 is brought up as soon as an interaction hint
+ * arrives or the online cores are saturated, is held up while video is
+ * being encoded (camera) or decoded, and is only taken down again after
+ * HOTPLUG_DOWN_SAMPLES consecutive samples below HOTPLUG_DOWN_LOAD.
+ * This replaces mpdecision, which post_boot no longer starts; the two
+ * would fight over cpu1.
+ */
+#define CPU1_ONLINE_PATH "/sys/devices/system/cpu/cpu1/online"
+#define PROC_STAT_PATH "/proc/stat"
+#define HOTPLUG_SAMPLE_MS_SCREEN_ON 100
+#define HOTPLUG_SAMPLE_MS_SCREEN_OFF 1000
+#define HOTPLUG_UP_LOAD 80
+#define HOTPLUG_DOWN_LOAD 25
+#define HOTPLUG_DOWN_SAMPLES_SCREEN_ON 20
+#define HOTPLUG_DOWN_SAMPLES_SCREEN_OFF 2
+#define HOTPLUG_INTERACTION_HOLD_MS 3000
+
+/*
+ * Thermal boost ceiling. The sensors and thresholds are taken from the
+ * thermald configuration, counting only thresholds whose action is "cpu",
+ * thermald's cpufreq limit. Between the last two of those on the hottest
+ * sensor the boostpulse duration is scaled down linearly, and hispeed_freq
+ * is capped to the action_info of the highest one crossed, but never below
+ * scaling_min_freq.
+ */
+#define THERMALD_CONF_PATH "/system/etc/thermald.conf"
+#define THERMAL_ZONE_PATH "/sys/devices/virtual/thermal/thermal_zone%d/%s"
+#define THERMAL_MAX_ZONES 16
+#define THERMAL_MAX_SENSORS 4
+#define THERMAL_MAX_THRESHOLDS 8
+#define THERMAL_SAMPLE_MS 2000
+#define HISPEED_FREQ 1134000
+#define SCALING_MIN_FREQ_PATH "/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq"
 
 struct cm_power_module {
     struct power_module base;
     pthread_mutex_t lock;
-    int boostpulse_fd;
+    /*
+     * boostpulse_fd, cpu1_online and thermal_scale are read without the
+     * lock on the hint path; lock is only taken to change them.
+     * boostpulse_fd is never closed once set, see boostpulse_reopen.
+     * interaction_pending is set by the hint path and turned into the
+     * interaction_until deadline by the hotplug thread under the lock.
+     * hispeed_freq is only read or written under the lock.
+     */
+    volatile int32_t boostpulse_fd;
     int boostpulse_warned;
+    pthread_cond_t hotplug_cond;
+    pthread_t hotplug_thread;
+    pthread_t governor_thread;
+    int hotplug_running;
+    volatile int32_t cpu1_online;
+    int screen_on;
+    int video_encode;
+    int video_decode;
+    volatile int32_t interaction_pending;
+    long long interaction_until;
+    volatile int32_t thermal_scale;
+};
+
+struct thermal_sensor {
+    char name[32];
+    char temp_path[64];
+    int level;
+    int num_thresholds;
+    int thresholds[THERMAL_MAX_THRESHOLDS];
+    int thresholds_clr[THERMAL_MAX_THRESHOLDS];
+    int action_info[THERMAL_MAX_THRESHOLDS];
+    int cpu_action[THERMAL_MAX_THRESHOLDS];
 };
 
 static char governor[20];
+static int hispeed_freq = HISPEED_FREQ;
+static struct thermal_sensor thermal_sensors[THERMAL_MAX_SENSORS];
+static int num_thermal_sensors;
 
 static int sysfs_read(char *path, char *s, int num_bytes)
 {
@@ -109,8 +186,347 @@ static int get_scaling_governor() {
     return 0;
 }
 
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int read_cpu_times(unsigned long long *busy, unsigned long long *total)
+{
+    char buf[256];
+    unsigned long long user, nice, system, idle, iowait, irq, softirq;
+
+    if (sysfs_read(PROC_STAT_PATH, buf, sizeof(buf)) == -1)
+        return -1;
+
+    if (sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice,
+                &system, &idle, &iowait, &irq, &softirq) != 7)
+        return -1;
+
+    *busy = user + nice + system + irq + softirq;
+    *total = *busy + idle + iowait;
+
+    return 0;
+}
+
+static int get_cpu1_online(void)
+{
+    char buf[4];
+
+    if (sysfs_read(CPU1_ONLINE_PATH, buf, sizeof(buf)) == -1)
+        return 0;
+
+    return buf[0] == '1';
+}
+
+/* Called with cm->lock held; drops it around the sysfs write. */
+static void set_cpu1_online(struct cm_power_module *cm, int online)
+{
+    if (cm->cpu1_online == online)
+        return;
+
+    android_atomic_release_store(online, &cm->cpu1_online);
+    pthread_mutex_unlock(&cm->lock);
+    sysfs_write(CPU1_ONLINE_PATH, online ? "1" : "0");
+    ALOGV("cpu1 %s", online ? "online" : "offline");
+    pthread_mutex_lock(&cm->lock);
+}
+
+static int parse_int_list(const char *s, int *list, int max)
+{
+    char *end;
+    int n = 0;
+
+    while (n < max) {
+        list[n] = strtol(s, &end, 10);
+        if (end == s)
+            break;
+        s = end;
+        n++;
+    }
+
+    return n;
+}
+
+/* Mark the thresholds whose action, or one of its '+' parts, is "cpu". */
+static void parse_actions(const char *s, int *cpu_action, int max)
+{
+    char action[32];
+    char *p, *save;
+    int n = 0, len;
+
+    while (n < max && sscanf(s, " %31s%n", action, &len) == 1) {
+        cpu_action[n] = 0;
+        for (p = strtok_r(action, "+", &save); p != NULL;
+                p = strtok_r(NULL, "+", &save))
+            if (strcmp(p, "cpu") == 0)
+                cpu_action[n] = 1;
+        s += len;
+        n++;
+    }
+}
+
+static int find_thermal_zone(struct thermal_sensor *sensor)
+{
+    char path[64];
+    char type[32];
+    int i, len;
+
+    for (i = 0; i < THERMAL_MAX_ZONES; i++) {
+        snprintf(path, sizeof(path), THERMAL_ZONE_PATH, i, "type");
+        if (access(path, R_OK) != 0)
+            continue;
+        if (sysfs_read(path, type, sizeof(type)) == -1)
+            continue;
+
+        len = strlen(type);
+        while (len > 0 && (type[len - 1] == '\n' || type[len - 1] == '\r'))
+            type[--len] = '\0';
+
+        if (strcmp(type, sensor->name) == 0) {
+            snprintf(sensor->temp_path, sizeof(sensor->temp_path),
+                    THERMAL_ZONE_PATH, i, "temp");
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void thermal_init(void)
+{
+    FILE *conf;
+    char line[128];
+    char name[32];
+    struct thermal_sensor *sensor = NULL;
+    int i, n;
+
+    conf = fopen(THERMALD_CONF_PATH, "r");
+    if (conf == NULL) {
+        ALOGW("No %s, boosts are not thermally limited", THERMALD_CONF_PATH);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), conf) != NULL) {
+        if (sscanf(line, " [%31[^]]]", name) == 1) {
+            sensor = NULL;
+            if (num_thermal_sensors < THERMAL_MAX_SENSORS) {
+                sensor = &thermal_sensors[num_thermal_sensors++];
+                memset(sensor, 0, sizeof(*sensor));
+                strlcpy(sensor->name, name, sizeof(sensor->name));
+            }
+        } else if (sensor == NULL) {
+            continue;
+        } else if (strncmp(line, "thresholds_clr", 14) == 0) {
+            parse_int_list(line + 14, sensor->thresholds_clr,
+                    THERMAL_MAX_THRESHOLDS);
+        } else if (strncmp(line, "thresholds", 10) == 0) {
+            sensor->num_thresholds = parse_int_list(line + 10,
+                    sensor->thresholds, THERMAL_MAX_THRESHOLDS);
+        } else if (strncmp(line, "action_info", 11) == 0) {
+            parse_int_list(line + 11, sensor->action_info,
+                    THERMAL_MAX_THRESHOLDS);
+        } else if (strncmp(line, "actions", 7) == 0) {
+            parse_actions(line + 7, sensor->cpu_action,
+                    THERMAL_MAX_THRESHOLDS);
+        }
+    }
+
+    fclose(conf);
+
+    /*
+     * Compact each sensor's cpu thresholds to the front, then drop sensors
+     * without any or without a matching thermal zone.
+     */
+    for (i = 0, n = 0; i < num_thermal_sensors; i++) {
+        int j, k;
+
+        sensor = &thermal_sensors[i];
+        for (j = 0, k = 0; j < sensor->num_thresholds; j++) {
+            if (!sensor->cpu_action[j])
+                continue;
+            sensor->thresholds[k] = sensor->thresholds[j];
+            sensor->thresholds_clr[k] = sensor->thresholds_clr[j];
+            sensor->action_info[k] = sensor->action_info[j];
+            k++;
+        }
+        sensor->num_thresholds = k;
+
+        if (sensor->num_thresholds == 0 || find_thermal_zone(sensor) < 0) {
+            ALOGW("Ignoring thermal sensor %s", sensor->name);
+            continue;
+        }
+        if (n != i)
+            thermal_sensors[n] = *sensor;
+        n++;
+    }
+    num_thermal_sensors = n;
+}
+
+/* Called without cm->lock held. */
+static void thermal_update(struct cm_power_module *cm)
+{
+    struct thermal_sensor *sensor;
+    char buf[16];
+    int scale = 100;
+    int hispeed = HISPEED_FREQ;
+    int i, temp, lo, hi, s;
+
+    for (i = 0; i < num_thermal_sensors; i++) {
+        sensor = &thermal_sensors[i];
+        if (sysfs_read(sensor->temp_path, buf, sizeof(buf)) == -1)
+            continue;
+
+        /* tsens reports degrees, the PMIC zones millidegrees. */
+        temp = atoi(buf);
+        if (temp > 1000)
+            temp /= 1000;
+
+        while (sensor->level < sensor->num_thresholds &&
+                temp >= sensor->thresholds[sensor->level])
+            sensor->level++;
+        while (sensor->level > 0 &&
+                temp <= sensor->thresholds_clr[sensor->level - 1])
+            sensor->level--;
+
+        if (sensor->level > 0 && sensor->action_info[sensor->level - 1] > 0 &&
+                sensor->action_info[sensor->level - 1] < hispeed)
+            hispeed = sensor->action_info[sensor->level - 1];
+
+        hi = sensor->thresholds[sensor->num_thresholds - 1];
+        lo = sensor->num_thresholds > 1 ?
+                sensor->thresholds[sensor->num_thresholds - 2] : hi - 10;
+        if (temp >= hi)
+            s = 0;
+        else if (temp <= lo)
+            s = 100;
+        else
+            s = (hi - temp) * 100 / (hi - lo);
+
+        if (s < scale)
+            scale = s;
+    }
+
+    /* Never cap below the floor post_boot sets. */
+    if (hispeed < HISPEED_FREQ &&
+            sysfs_read(SCALING_MIN_FREQ_PATH, buf, sizeof(buf)) == 0 &&
+            hispeed < atoi(buf))
+        hispeed = atoi(buf);
+
+    pthread_mutex_lock(&cm->lock);
+    android_atomic_release_store(scale, &cm->thermal_scale);
+
+    if (hispeed_freq != hispeed) {
+        hispeed_freq = hispeed;
+        if (strncmp(governor, "interactive", 11) == 0) {
+            snprintf(buf, sizeof(buf), "%d", hispeed);
+            sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/hispeed_freq",
+                    buf);
+            ALOGD("Thermal hispeed_freq ceiling %d", hispeed);
+        }
+    }
+
+    pthread_mutex_unlock(&cm->lock);
+}
+
+static void *hotplug_thread(void *arg)
+{
+    struct cm_power_module *cm = (struct cm_power_module *) arg;
+    unsigned long long busy, total, prev_busy = 0, prev_total = 0;
+    struct timespec reltime;
+    int idle_samples = 0;
+    int load = 0;
+    int sample_ms;
+    int down_samples;
+    long long next_thermal = 0;
+
+    read_cpu_times(&prev_busy, &prev_total);
+
+    pthread_mutex_lock(&cm->lock);
+
+    while (cm->hotplug_running) {
+        sample_ms = cm->screen_on ? HOTPLUG_SAMPLE_MS_SCREEN_ON :
+                HOTPLUG_SAMPLE_MS_SCREEN_OFF;
+        reltime.tv_sec = sample_ms / 1000;
+        reltime.tv_nsec = (sample_ms % 1000) * 1000000;
+        pthread_cond_timedwait_relative_np(&cm->hotplug_cond, &cm->lock,
+                &reltime);
+
+        if (num_thermal_sensors > 0 && now_ms() >= next_thermal) {
+            next_thermal = now_ms() + THERMAL_SAMPLE_MS;
+            pthread_mutex_unlock(&cm->lock);
+            thermal_update(cm);
+            pthread_mutex_lock(&cm->lock);
+        }
+
+        if (read_cpu_times(&busy, &total) == 0 && total > prev_total) {
+            load = (int) ((busy - prev_busy) * 100 / (total - prev_total));
+            prev_busy = busy;
+            prev_total = total;
+        }
+
+        if (cm->interaction_pending &&
+                android_atomic_acquire_cas(1, 0, &cm->interaction_pending) == 0)
+            cm->interaction_until = now_ms() + HOTPLUG_INTERACTION_HOLD_MS;
+
+        if (cm->video_encode || cm->video_decode ||
+                now_ms() < cm->interaction_until) {
+            idle_samples = 0;
+            set_cpu1_online(cm, 1);
+            continue;
+        }
+
+        if (!cm->cpu1_online) {
+            if (load >= HOTPLUG_UP_LOAD)
+                set_cpu1_online(cm, 1);
+            continue;
+        }
+
+        down_samples = cm->screen_on ? HOTPLUG_DOWN_SAMPLES_SCREEN_ON :
+                HOTPLUG_DOWN_SAMPLES_SCREEN_OFF;
+
+        if (load < HOTPLUG_DOWN_LOAD)
+            idle_samples++;
+        else
+            idle_samples = 0;
+
+        if (idle_samples >= down_samples) {
+            idle_samples = 0;
+            set_cpu1_online(cm, 0);
+        }
+    }
+
+    pthread_mutex_unlock(&cm->lock);
+    return NULL;
+}
+
+static void hotplug_start(struct cm_power_module *cm)
+{
+    pthread_mutex_lock(&cm->lock);
+    android_atomic_release_store(get_cpu1_online(), &cm->cpu1_online);
+    cm->hotplug_running = 1;
+    pthread_mutex_unlock(&cm->lock);
+
+    if (pthread_create(&cm->hotplug_thread, NULL, hotplug_thread, cm)) {
+        ALOGE("Error creating hotplug thread");
+        cm->hotplug_running = 0;
+    }
+}
+
 static void cm_power_set_interactive(struct power_module *module, int on)
 {
+    struct cm_power_module *cm = (struct cm_power_module *) module;
+
+    if (cm != NULL) {
+        pthread_mutex_lock(&cm->lock);
+        cm->screen_on = on;
+        pthread_cond_signal(&cm->hotplug_cond);
+        pthread_mutex_unlock(&cm->lock);
+    }
+
     if (strncmp(governor, "ondemand", 8) == 0)
         sysfs_write("/sys/devices/system/cpu/cpufreq/ondemand/sampling_rate",
                 on ? SAMPLING_RATE_SCREEN_ON : SAMPLING_RATE_SCREEN_OFF);
@@ -120,8 +536,12 @@ static void cm_power_set_interactive(struct power_module *module, int on)
 }
 
 
+/* Called with cm->lock held, or before any thread is started. */
 static void configure_governor()
 {
+    char hispeed[16];
+
+    snprintf(hispeed, sizeof(hispeed), "%d", hispeed_freq);
     cm_power_set_interactive(NULL, 1);
 
     if (strncmp(governor, "ondemand", 8) == 0) {
@@ -133,40 +553,179 @@ static void configure_governor()
     } else if (strncmp(governor, "interactive", 11) == 0) {
         sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/min_sample_time", "90000");
         sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/io_is_busy", "1");
-        sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/hispeed_freq", "1134000");
+        sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/hispeed_freq", hispeed);
         sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/above_hispeed_delay", "30000");
     }
 }
 
+/* Called with cm->lock held, after get_scaling_governor. */
+static int boostpulse_node_open(void)
+{
+    if (strncmp(governor, "ondemand", 8) == 0)
+        return open(BOOSTPULSE_ONDEMAND, O_WRONLY);
+    if (strncmp(governor, "interactive", 11) == 0)
+        return open(BOOSTPULSE_INTERACTIVE, O_WRONLY);
+
+    errno = ENOENT;
+    return -1;
+}
+
 static int boostpulse_open(struct cm_power_module *cm)
 {
     char buf[80];
+    int fd;
+
+    /* Fast path: already open, no lock needed. */
+    fd = android_atomic_acquire_load(&cm->boostpulse_fd);
+    if (fd >= 0)
+        return fd;
 
     pthread_mutex_lock(&cm->lock);
 
-    if (cm->boostpulse_fd < 0) {
+    fd = cm->boostpulse_fd;
+    if (fd < 0) {
         if (get_scaling_governor() < 0) {
             ALOGE("Can't read scaling governor.");
             cm->boostpulse_warned = 1;
         } else {
-            if (strncmp(governor, "ondemand", 8) == 0)
-                cm->boostpulse_fd = open(BOOSTPULSE_ONDEMAND, O_WRONLY);
-            else if (strncmp(governor, "interactive", 11) == 0)
-                cm->boostpulse_fd = open(BOOSTPULSE_INTERACTIVE, O_WRONLY);
+            fd = boostpulse_node_open();
 
-            if (cm->boostpulse_fd < 0 && !cm->boostpulse_warned) {
+            if (fd < 0 && !cm->boostpulse_warned) {
                 strerror_r(errno, buf, sizeof(buf));
                 ALOGV("Error opening boostpulse: %s\n", buf);
                 cm->boostpulse_warned = 1;
-            } else if (cm->boostpulse_fd > 0) {
+            } else if (fd >= 0) {
                 configure_governor();
+                android_atomic_release_store(fd, &cm->boostpulse_fd);
                 ALOGD("Opened %s boostpulse interface", governor);
             }
         }
     }
 
     pthread_mutex_unlock(&cm->lock);
-    return cm->boostpulse_fd;
+    return fd;
+}
+
+/*
+ * Point the published boostpulse fd at the current governor's node, or at
+ * /dev/null if it has none. The hint path writes to the fd without the
+ * lock, so once published it is never closed or renumbered; the new node
+ * is dup2()ed over it instead, which swaps the file atomically. Called
+ * with cm->lock held.
+ */
+static void boostpulse_reopen(struct cm_power_module *cm)
+{
+    char buf[80];
+    int fd;
+
+    if (cm->boostpulse_fd < 0)
+        return;
+
+    fd = boostpulse_node_open();
+    if (fd < 0)
+        fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+        return;
+
+    if (dup2(fd, cm->boostpulse_fd) < 0) {
+        strerror_r(errno, buf, sizeof(buf));
+        ALOGE("Error reopening boostpulse: %s\n", buf);
+    }
+    close(fd);
+}
+
+/*
+ * Watch scaling_governor so that a runtime governor switch (post_boot
+ * scripts, user tools) immediately re-tunes the new governor and moves
+ * boostpulse to its node, instead of leaving a stale fd behind. sysfs does
+ * not notify governor changes, but userspace writes still raise
+ * IN_MODIFY; if inotify is unavailable the file is polled instead.
+ */
+static void governor_changed(struct cm_power_module *cm)
+{
+    char old_governor[sizeof(governor)];
+
+    pthread_mutex_lock(&cm->lock);
+
+    strlcpy(old_governor, governor, sizeof(old_governor));
+    if (get_scaling_governor() < 0 || strcmp(old_governor, governor) == 0) {
+        pthread_mutex_unlock(&cm->lock);
+        return;
+    }
+
+    ALOGD("Scaling governor changed from %s to %s", old_governor, governor);
+
+    if (cm->boostpulse_fd >= 0) {
+        boostpulse_reopen(cm);
+        configure_governor();
+        pthread_mutex_unlock(&cm->lock);
+        return;
+    }
+
+    pthread_mutex_unlock(&cm->lock);
+
+    /* Opens boostpulse and reconfigures the governor tunables. */
+    if (boostpulse_open(cm) < 0) {
+        pthread_mutex_lock(&cm->lock);
+        configure_governor();
+        pthread_mutex_unlock(&cm->lock);
+    }
+}
+
+static void *governor_thread(void *arg)
+{
+    struct cm_power_module *cm = (struct cm_power_module *) arg;
+    char buf[sizeof(struct inotify_event) * 16];
+    struct pollfd pfd;
+    int wd = -1;
+
+    pfd.fd = inotify_init();
+    pfd.events = POLLIN;
+
+    if (pfd.fd >= 0)
+        wd = inotify_add_watch(pfd.fd, SCALING_GOVERNOR_PATH, IN_MODIFY);
+
+    if (wd < 0) {
+        ALOGW("Can't watch %s, polling every %d ms", SCALING_GOVERNOR_PATH,
+                GOVERNOR_POLL_MS);
+        if (pfd.fd >= 0)
+            close(pfd.fd);
+
+        for (;;) {
+            usleep(GOVERNOR_POLL_MS * 1000);
+            governor_changed(cm);
+        }
+    }
+
+    for (;;) {
+        if (poll(&pfd, 1, -1) <= 0)
+            continue;
+
+        /* Drain all pending events, one re-read covers them. */
+        if (read(pfd.fd, buf, sizeof(buf)) > 0)
+            governor_changed(cm);
+    }
+
+    return NULL;
+}
+
+/*
+ * The camera and video stacks pass the video hints a metadata string,
+ * "state=1" when a session starts and "state=0" when it ends. Returns the
+ * state, or -1 if the payload isn't one of those.
+ */
+static int video_hint_state(const void *data)
+{
+    const char *p;
+
+    if (data == NULL)
+        return -1;
+
+    p = strstr((const char *) data, "state=");
+    if (p == NULL || (p[6] != '0' && p[6] != '1'))
+        return -1;
+
+    return p[6] - '0';
 }
 
 static void cm_power_hint(struct power_module *module, power_hint_t hint,
@@ -175,31 +734,65 @@ static void cm_power_hint(struct power_module *module, power_hint_t hint,
     struct cm_power_module *cm = (struct cm_power_module *) module;
     char buf[80];
     int len;
+    int fd;
+    int scale;
+    int state;
     int duration = 1;
 
     switch (hint) {
     case POWER_HINT_INTERACTION:
     case POWER_HINT_CPU_BOOST:
-        if (boostpulse_open(cm) >= 0) {
+        android_atomic_release_store(1, &cm->interaction_pending);
+        if (!android_atomic_acquire_load(&cm->cpu1_online))
+            pthread_cond_signal(&cm->hotplug_cond);
+
+        scale = android_atomic_acquire_load(&cm->thermal_scale);
+        if (scale == 0)
+            break;
+
+        if ((fd = boostpulse_open(cm)) >= 0) {
             if (data != NULL)
                 duration = (int) data;
 
+            duration = duration * scale / 100;
+            if (duration < 1)
+                duration = 1;
+
             snprintf(buf, sizeof(buf), "%d", duration);
-            len = write(cm->boostpulse_fd, buf, strlen(buf));
+            len = write(fd, buf, strlen(buf));
 
             if (len < 0) {
                 strerror_r(errno, buf, sizeof(buf));
 	            ALOGE("Error writing to boostpulse: %s\n", buf);
 
+                /*
+                 * The governor may have changed. Refreshing it here hides
+                 * the change from governor_changed, so re-tune it here.
+                 */
                 pthread_mutex_lock(&cm->lock);
-                close(cm->boostpulse_fd);
-                cm->boostpulse_fd = -1;
-                cm->boostpulse_warned = 0;
+                get_scaling_governor();
+                boostpulse_reopen(cm);
+                configure_governor();
                 pthread_mutex_unlock(&cm->lock);
             }
         }
         break;
 
+    case POWER_HINT_VIDEO_ENCODE:
+    case POWER_HINT_VIDEO_DECODE:
+        state = video_hint_state(data);
+        if (state < 0)
+            break;
+
+        pthread_mutex_lock(&cm->lock);
+        if (hint == POWER_HINT_VIDEO_ENCODE)
+            cm->video_encode = state;
+        else
+            cm->video_decode = state;
+        pthread_cond_signal(&cm->hotplug_cond);
+        pthread_mutex_unlock(&cm->lock);
+        break;
+
     case POWER_HINT_VSYNC:
         break;
 
@@ -210,8 +803,15 @@ static void cm_power_hint(struct power_module *module, power_hint_t hint,
 
 static void cm_power_init(struct power_module *module)
 {
+    struct cm_power_module *cm = (struct cm_power_module *) module;
+
     get_scaling_governor();
     configure_governor();
+    thermal_init();
+    hotplug_start(cm);
+
+    if (pthread_create(&cm->governor_thread, NULL, governor_thread, cm))
+        ALOGE("Error creating governor watch thread");
 }
 
 static struct hw_module_methods_t power_module_methods = {
@@ -237,4 +837,13 @@ struct cm_power_module HAL_MODULE_INFO_SYM = {
     lock: PTHREAD_MUTEX_INITIALIZER,
     boostpulse_fd: -1,
     boostpulse_warned: 0,
+    hotplug_cond: PTHREAD_COND_INITIALIZER,
+    hotplug_running: 0,
+    cpu1_online: 0,
+    screen_on: 1,
+    video_encode: 0,
+    video_decode: 0,
+    interaction_pending: 0,
+    interaction_until: 0,
+    thermal_scale: 100,
 };
@@ -0,0 +1,38 @@
+LOCAL_PATH := $(call my-dir)
+
+# graphics.c itself is built into minui through BOARD_CUSTOM_GRAPHICS, as
+# graphics_soft.c when the soft raster is wanted.
+
+# gr_bench: times the gr_soft.h kernels against pixelflinger
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := gr_bench.c
+LOCAL_SHARED_LIBRARIES := libpixelflinger
+LOCAL_MODULE := gr_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
+# gr_frame_bench: replays a recovery session on the headless backend. It
+# runs on the build host with the soft raster; gr_host_ggl.c stands in for
+# libpixelflinger, so the few blits the soft raster can't do aren't drawn.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := gr_frame_bench.c graphics.c gr_host_ggl.c
+LOCAL_C_INCLUDES += bootable/recovery/minui
+LOCAL_CFLAGS += -DRECOVERY_SOFT_RASTER
+LOCAL_LDLIBS += -lpthread -lrt
+LOCAL_MODULE := gr_frame_bench
+LOCAL_MODULE_TAGS := optional
+
+ifeq ($(subst ",,$(TARGET_RECOVERY_PIXEL_FORMAT)),RGBX_8888)
+  LOCAL_CFLAGS += -DRECOVERY_RGBX
+endif
+ifeq ($(subst ",,$(TARGET_RECOVERY_PIXEL_FORMAT)),BGRA_8888)
+  LOCAL_CFLAGS += -DRECOVERY_BGRA
+endif
+ifneq ($(BOARD_USE_CUSTOM_RECOVERY_FONT),)
+  LOCAL_CFLAGS += -DBOARD_USE_CUSTOM_RECOVERY_FONT=$(BOARD_USE_CUSTOM_RECOVERY_FONT)
+endif
+
+include $(BUILD_HOST_EXECUTABLE)
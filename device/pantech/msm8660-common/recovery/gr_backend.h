@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GR_BACKEND_H
+#define _GR_BACKEND_H
+
+#if __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    unsigned flips;
+    unsigned long long bytes_copied;    /* between pages or from memory */
+} GRStats;
+
+/**
+ * Render into memory instead of /dev/graphics/fb0 and leave the console
+ * alone. Must be called before gr_init.
+ *
+ * @param pages framebuffer pages, 2 or 3
+ * @return 0 on success, -1 if the arguments are out of range or the
+ *         graphics are already initialized
+ */
+int gr_use_headless(unsigned width, unsigned height, unsigned pages);
+
+/**
+ * Counters since gr_init or the last gr_reset_stats.
+ */
+void gr_get_stats(GRStats *stats);
+void gr_reset_stats(void);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _GR_BACKEND_H
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times the gr_soft.h kernels against the pixelflinger calls the recovery
+ * graphics would otherwise make, on an off-screen surface of the panel's
+ * size. Usage: gr_bench [width height [iterations]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "gr_soft.h"
+
+#define GLYPH_W 10
+#define GLYPH_H 18
+
+static GGLContext *gl;
+static GGLSurface surface;
+static GGLSurface glyphs;
+static GGLSurface image;
+static int iterations = 100;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(const char *name, double ggl_ms, double soft_ms,
+                   unsigned pixels)
+{
+    double mpix = (double) pixels * iterations / 1000000.0;
+
+    printf("%-14s ggl %8.2f ms (%7.1f Mpix/s)  soft %8.2f ms (%7.1f Mpix/s)  x%.2f\n",
+           name, ggl_ms / iterations, mpix / (ggl_ms / 1000.0),
+           soft_ms / iterations, mpix / (soft_ms / 1000.0), ggl_ms / soft_ms);
+}
+
+static void set_color(int r, int g, int b, int a)
+{
+    GGLint color[4];
+
+    color[0] = ((r << 8) | r) + 1;
+    color[1] = ((g << 8) | g) + 1;
+    color[2] = ((b << 8) | b) + 1;
+    color[3] = ((a << 8) | a) + 1;
+    gl->color4xv(gl, color);
+}
+
+static void bench_fill(int alpha)
+{
+    uint8_t c[4] = { 0x20, 0x80, 0xe0, 0xff };
+    double t, ggl, soft;
+    int i;
+
+    set_color(c[0], c[1], c[2], alpha);
+    gl->disable(gl, GGL_TEXTURE_2D);
+
+    t = now_ms();
+    for (i = 0; i < iterations; i++)
+        gl->recti(gl, 0, 0, surface.width, surface.height);
+    ggl = now_ms() - t;
+
+    t = now_ms();
+    for (i = 0; i < iterations; i++) {
+        if (alpha == 0xff)
+            gr_soft_fill32(surface.data, surface.stride * 4, surface.width,
+                           surface.height, c);
+        else
+            gr_soft_blend32(surface.data, surface.stride * 4, surface.width,
+                            surface.height, c, alpha);
+    }
+    soft = now_ms() - t;
+
+    report(alpha == 0xff ? "fill" : "fill (blend)", ggl, soft,
+           surface.width * surface.height);
+}
+
+static void bench_text(void)
+{
+    uint8_t c[4] = { 0xff, 0xff, 0xff, 0xff };
+    unsigned cols = surface.width / GLYPH_W, rows = surface.height / GLYPH_H;
+    double t, ggl, soft;
+    unsigned x, y;
+    int i;
+
+    set_color(c[0], c[1], c[2], c[3]);
+    gl->bindTexture(gl, &glyphs);
+    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->enable(gl, GGL_TEXTURE_2D);
+
+    t = now_ms();
+    for (i = 0; i < iterations; i++) {
+        for (y = 0; y < rows; y++) {
+            for (x = 0; x < cols; x++) {
+                int off = (x + y) % 96;
+                gl->texCoord2i(gl, off * GLYPH_W - x * GLYPH_W, 0 - y * GLYPH_H);
+                gl->recti(gl, x * GLYPH_W, y * GLYPH_H,
+                          (x + 1) * GLYPH_W, (y + 1) * GLYPH_H);
+            }
+        }
+    }
+    ggl = now_ms() - t;
+
+    t = now_ms();
+    for (i = 0; i < iterations; i++) {
+        for (y = 0; y < rows; y++) {
+            for (x = 0; x < cols; x++) {
+                int off = (x + y) % 96;
+                gr_soft_glyph32(surface.data + (y * GLYPH_H * surface.stride +
+                                                x * GLYPH_W) * 4,
+                                surface.stride * 4, glyphs.data + off * GLYPH_W,
+                                glyphs.stride, GLYPH_W, GLYPH_H, c);
+            }
+        }
+    }
+    soft = now_ms() - t;
+
+    report("text", ggl, soft, cols * rows * GLYPH_W * GLYPH_H);
+}
+
+static void bench_blit(GGLenum format, const char *name)
+{
+    double t, ggl, soft;
+    int i;
+
+    image.format = format;
+    gl->bindTexture(gl, &image);
+    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->enable(gl, GGL_TEXTURE_2D);
+
+    t = now_ms();
+    for (i = 0; i < iterations; i++) {
+        gl->texCoord2i(gl, 0, 0);
+        gl->recti(gl, 0, 0, image.width, image.height);
+    }
+    ggl = now_ms() - t;
+
+    t = now_ms();
+    for (i = 0; i < iterations; i++) {
+        if (format == GGL_PIXEL_FORMAT_RGBX_8888)
+            gr_soft_copy(surface.data, surface.stride * 4, image.data,
+                         image.stride * 4, image.width * 4, image.height);
+        else
+            gr_soft_blit_alpha32(surface.data, surface.stride * 4, image.data,
+                                 image.stride * 4, image.width, image.height);
+    }
+    soft = now_ms() - t;
+
+    report(name, ggl, soft, image.width * image.height);
+}
+
+static void init_surface(GGLSurface *s, unsigned w, unsigned h,
+                         unsigned bpp, GGLenum format)
+{
+    unsigned i;
+
+    s->version = sizeof(*s);
+    s->width = w;
+    s->height = h;
+    s->stride = w;
+    s->format = format;
+    s->data = malloc(w * h * bpp);
+    for (i = 0; i < w * h * bpp; i++)
+        s->data[i] = rand();
+}
+
+int main(int argc, char **argv)
+{
+    unsigned width = 480, height = 800;
+
+    if (argc >= 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        iterations = atoi(argv[3]);
+    if (width == 0 || height == 0 || iterations <= 0) {
+        fprintf(stderr, "usage: %s [width height [iterations]]\n", argv[0]);
+        return 1;
+    }
+
+    gglInit(&gl);
+
+    init_surface(&surface, width, height, 4, GGL_PIXEL_FORMAT_RGBX_8888);
+    init_surface(&glyphs, 96 * GLYPH_W, GLYPH_H, 1, GGL_PIXEL_FORMAT_A_8);
+    init_surface(&image, width, height / 2, 4, GGL_PIXEL_FORMAT_RGBX_8888);
+
+    gl->colorBuffer(gl, &surface);
+    gl->activeTexture(gl, 0);
+    gl->enable(gl, GGL_BLEND);
+    gl->blendFunc(gl, GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA);
+
+    printf("%ux%u RGBX_8888, %d iterations, %s kernels\n", width, height,
+           iterations,
+#ifdef __ARM_NEON__
+           "NEON"
+#else
+           "C"
+#endif
+           );
+
+    bench_fill(0xff);
+    bench_fill(0x80);
+    bench_text();
+    bench_blit(GGL_PIXEL_FORMAT_RGBX_8888, "blit (opaque)");
+    bench_blit(GGL_PIXEL_FORMAT_RGBA_8888, "blit (alpha)");
+
+    gglUninit(gl);
+    return 0;
+}
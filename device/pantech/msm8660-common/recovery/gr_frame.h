@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GR_FRAME_H
+#define _GR_FRAME_H
+
+#if __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Ask for the screen to be redrawn. Safe to call from any thread; any
+ * number of requests made before the render loop next wakes up collapse
+ * into a single redraw.
+ */
+void gr_frame_request(void);
+
+/**
+ * Wait for a redraw request and consume it. The render loop draws and
+ * calls gr_flip when this returns 1; gr_flip itself holds the pan to the
+ * next vblank, so at most one frame reaches the screen per refresh.
+ *
+ * @param timeout_ms milliseconds to wait, 0 to poll, negative for ever
+ * @return 1 if a redraw was requested, 0 on timeout
+ */
+int gr_frame_wait(int timeout_ms);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _GR_FRAME_H
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays a recovery UI session (menu navigation, a package install with
+ * its progress bar and log, a full-screen icon) against the headless
+ * graphics backend and reports frame times, flip rate and the bytes
+ * graphics.c copied between pages.
+ * Usage: gr_frame_bench [width height [pages [frames]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "minui.h"
+#include "gr_backend.h"
+
+#define MENU_ITEMS 9
+#define LOG_LINES 12
+
+static const char *menu[MENU_ITEMS] = {
+    "reboot system now",
+    "install zip from sdcard",
+    "wipe data/factory reset",
+    "wipe cache partition",
+    "backup and restore",
+    "mounts and storage",
+    "advanced",
+    "power off",
+    "\xc2\xbb go back",
+};
+
+static GGLSurface icon;
+static int width, height, char_w, char_h;
+static int frames = 300;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void make_icon(unsigned size)
+{
+    unsigned x, y, r2 = size * size / 4;
+    uint8_t *p;
+
+    icon.version = sizeof(icon);
+    icon.width = size;
+    icon.height = size;
+    icon.stride = size;
+    icon.format = GGL_PIXEL_FORMAT_RGBA_8888;
+    icon.data = malloc(size * size * 4);
+
+    /* a soft-edged disc: opaque middle, translucent rim, clear corners */
+    p = icon.data;
+    for (y = 0; y < size; y++) {
+        for (x = 0; x < size; x++, p += 4) {
+            int dx = x - size / 2, dy = y - size / 2;
+            unsigned d2 = dx * dx + dy * dy;
+
+            p[0] = 0x30 + x * 0x80 / size;
+            p[1] = 0xa0;
+            p[2] = 0x30 + y * 0x80 / size;
+            p[3] = d2 >= r2 ? 0 : d2 >= r2 * 3 / 4 ? 0x80 : 0xff;
+        }
+    }
+}
+
+static void draw_background(void)
+{
+    gr_color(0, 0, 0, 255);
+    gr_fill(0, 0, width, height);
+}
+
+static void draw_menu(int selected)
+{
+    int i, y;
+
+    gr_color(64, 96, 255, 255);
+    gr_text(0, char_h, "CWM-based Recovery");
+
+    for (i = 0, y = char_h * 3; i < MENU_ITEMS; i++, y += char_h) {
+        if (i == selected) {
+            gr_color(64, 96, 255, 255);
+            gr_fill(0, y - 2, width, y + char_h);
+            gr_color(255, 255, 255, 255);
+        } else {
+            gr_color(64, 96, 255, 255);
+        }
+        gr_text(0, y + char_h - 2, menu[i]);
+    }
+}
+
+static void draw_install(int frame, int total)
+{
+    char line[64];
+    int bar_w = width * 2 / 3, bar_x = (width - bar_w) / 2;
+    int bar_y = height * 3 / 4, i, first;
+
+    gr_blit(&icon, 0, 0, icon.width, icon.height,
+            (width - icon.width) / 2, height / 4);
+
+    gr_color(64, 64, 64, 255);
+    gr_fill(bar_x, bar_y, bar_x + bar_w, bar_y + char_h);
+    gr_color(64, 96, 255, 255);
+    gr_fill(bar_x, bar_y, bar_x + bar_w * frame / total, bar_y + char_h);
+
+    first = frame / 4 > LOG_LINES ? frame / 4 - LOG_LINES : 0;
+    gr_color(255, 255, 0, 255);
+    for (i = first; i <= frame / 4; i++) {
+        snprintf(line, sizeof(line), "extracting system/app/%04d.apk", i);
+        gr_text(0, bar_y + char_h * (3 + i - first), line);
+    }
+}
+
+static void draw_dim_overlay(int frame)
+{
+    gr_color(0, 0, 0, 128);
+    gr_fill(0, 0, width, height);
+    gr_color(255, 255, 255, 255);
+    gr_text(width / 4, height / 2, frame & 16 ? "Formatting /data..." : "");
+}
+
+static void report(const char *name, int count, double ms)
+{
+    GRStats stats;
+
+    gr_get_stats(&stats);
+    printf("%-10s %5d frames  %7.3f ms/frame  %8.1f flips/s  %9llu bytes copied/flip\n",
+           name, count, ms / count, stats.flips * 1000.0 / ms,
+           stats.flips ? stats.bytes_copied / stats.flips : 0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned w = 480, h = 800, pages = 3;
+    double t;
+    int i;
+
+    if (argc >= 3) {
+        w = atoi(argv[1]);
+        h = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        pages = atoi(argv[3]);
+    if (argc >= 5)
+        frames = atoi(argv[4]);
+    if (frames <= 0 || gr_use_headless(w, h, pages) < 0) {
+        fprintf(stderr, "usage: %s [width height [pages [frames]]]\n", argv[0]);
+        return 1;
+    }
+
+    if (gr_init() < 0)
+        return 1;
+    width = gr_fb_width();
+    height = gr_fb_height();
+    gr_font_size(&char_w, &char_h);
+    make_icon(width / 2);
+
+    printf("%dx%d, %u pages\n", width, height, pages);
+
+    /* moving the highlight: full redraw every frame */
+    gr_reset_stats();
+    t = now_ms();
+    for (i = 0; i < frames; i++) {
+        draw_background();
+        draw_menu(i % MENU_ITEMS);
+        gr_flip();
+    }
+    report("menu", frames, now_ms() - t);
+
+    /* installing: icon, progress bar and scrolling log */
+    gr_reset_stats();
+    t = now_ms();
+    for (i = 0; i < frames; i++) {
+        draw_background();
+        draw_install(i, frames);
+        gr_flip();
+    }
+    report("install", frames, now_ms() - t);
+
+    /* progress only: the rest of the screen is left alone */
+    gr_reset_stats();
+    t = now_ms();
+    for (i = 0; i < frames; i++) {
+        gr_color(64, 96, 255, 255);
+        gr_fill(width / 6, height * 3 / 4, width / 6 + width * 2 / 3 * i / frames,
+                height * 3 / 4 + char_h);
+        gr_flip();
+    }
+    report("progress", frames, now_ms() - t);
+
+    /* translucent overlay over the menu */
+    gr_reset_stats();
+    t = now_ms();
+    for (i = 0; i < frames; i++) {
+        draw_background();
+        draw_menu(2);
+        draw_dim_overlay(i);
+        gr_flip();
+    }
+    report("overlay", frames, now_ms() - t);
+
+    gr_exit();
+    free(icon.data);
+    return 0;
+}
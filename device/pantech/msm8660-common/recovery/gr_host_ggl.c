@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A pixelflinger context that draws nothing, for host builds of
+ * graphics.c, where libpixelflinger isn't available. With
+ * RECOVERY_SOFT_RASTER everything but blits the soft path can't handle
+ * is drawn without it; those are silently dropped.
+ */
+
+#include <stdlib.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+static void host_surface(void *c, const GGLSurface *surface)
+{
+}
+
+static void host_active_texture(void *c, GGLuint tmu)
+{
+}
+
+static void host_tex_param(void *c, GGLenum target, GGLenum pname,
+                           GGLint param)
+{
+}
+
+static void host_enable(void *c, GGLenum name)
+{
+}
+
+static void host_tex_coord(void *c, GGLint x, GGLint y)
+{
+}
+
+static void host_rect(void *c, GGLint l, GGLint t, GGLint r, GGLint b)
+{
+}
+
+static void host_color(void *c, const GGLclampx *color)
+{
+}
+
+static void host_blend_func(void *c, GGLenum src, GGLenum dst)
+{
+}
+
+ssize_t gglInit(GGLContext **context)
+{
+    GGLContext *c = calloc(1, sizeof(*c));
+
+    if (c == NULL)
+        return -1;
+
+    c->colorBuffer = host_surface;
+    c->bindTexture = host_surface;
+    c->activeTexture = host_active_texture;
+    c->texEnvi = host_tex_param;
+    c->texGeni = host_tex_param;
+    c->enable = host_enable;
+    c->disable = host_enable;
+    c->texCoord2i = host_tex_coord;
+    c->recti = host_rect;
+    c->color4xv = host_color;
+    c->blendFunc = host_blend_func;
+
+    *context = c;
+    return 0;
+}
+
+ssize_t gglUninit(GGLContext *c)
+{
+    free(c);
+    return 0;
+}
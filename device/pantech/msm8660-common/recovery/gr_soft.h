@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Software raster kernels for the recovery's fixed framebuffer formats.
+ *
+ * The 32-bit kernels work on raw bytes, so they serve both RGBX_8888 and
+ * BGRA_8888 as long as the colour is handed in already in framebuffer
+ * byte order. Strides are in bytes. With __ARM_NEON__ the inner loops
+ * handle 8 (or 16) pixels per iteration and finish the tail in C.
+ */
+
+#ifndef _GR_SOFT_H
+#define _GR_SOFT_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+/* (s * a + d * (255 - a)) / 255, rounded */
+static inline uint8_t gr_soft_mix(uint8_t s, uint8_t d, unsigned a)
+{
+    unsigned t = s * a + d * (255 - a) + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+#ifdef __ARM_NEON__
+static inline uint8x8_t gr_soft_mix8(uint8x8_t s, uint8x8_t d,
+                                     uint8x8_t a, uint8x8_t ia)
+{
+    uint16x8_t t = vmull_u8(s, a);
+    t = vmlal_u8(t, d, ia);
+    return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+#endif
+
+static inline void gr_soft_fill32(uint8_t *dst, int stride, int w, int h,
+                                  const uint8_t c[4])
+{
+    uint32_t pixel;
+    int x;
+
+    memcpy(&pixel, c, 4);
+
+    for (; h > 0; h--, dst += stride) {
+        uint32_t *p = (uint32_t *) dst;
+        x = 0;
+#ifdef __ARM_NEON__
+        {
+            uint32x4_t v = vdupq_n_u32(pixel);
+            for (; x + 8 <= w; x += 8) {
+                vst1q_u32(p + x, v);
+                vst1q_u32(p + x + 4, v);
+            }
+        }
+#endif
+        for (; x < w; x++)
+            p[x] = pixel;
+    }
+}
+
+static inline void gr_soft_fill16(uint8_t *dst, int stride, int w, int h,
+                                  uint16_t pixel)
+{
+    int x;
+
+    for (; h > 0; h--, dst += stride) {
+        uint16_t *p = (uint16_t *) dst;
+        x = 0;
+#ifdef __ARM_NEON__
+        {
+            uint16x8_t v = vdupq_n_u16(pixel);
+            for (; x + 16 <= w; x += 16) {
+                vst1q_u16(p + x, v);
+                vst1q_u16(p + x + 8, v);
+            }
+        }
+#endif
+        for (; x < w; x++)
+            p[x] = pixel;
+    }
+}
+
+static inline void gr_soft_blend32(uint8_t *dst, int stride, int w, int h,
+                                   const uint8_t c[4], unsigned a)
+{
+    int x;
+
+    for (; h > 0; h--, dst += stride) {
+        uint8_t *p = dst;
+        x = 0;
+#ifdef __ARM_NEON__
+        {
+            uint8x8_t va = vdup_n_u8(a), via = vdup_n_u8(255 - a);
+            for (; x + 8 <= w; x += 8, p += 32) {
+                uint8x8x4_t d = vld4_u8(p);
+                d.val[0] = gr_soft_mix8(vdup_n_u8(c[0]), d.val[0], va, via);
+                d.val[1] = gr_soft_mix8(vdup_n_u8(c[1]), d.val[1], va, via);
+                d.val[2] = gr_soft_mix8(vdup_n_u8(c[2]), d.val[2], va, via);
+                d.val[3] = gr_soft_mix8(vdup_n_u8(c[3]), d.val[3], va, via);
+                vst4_u8(p, d);
+            }
+        }
+#endif
+        for (; x < w; x++, p += 4) {
+            p[0] = gr_soft_mix(c[0], p[0], a);
+            p[1] = gr_soft_mix(c[1], p[1], a);
+            p[2] = gr_soft_mix(c[2], p[2], a);
+            p[3] = gr_soft_mix(c[3], p[3], a);
+        }
+    }
+}
+
+static inline uint16_t gr_soft_mix565(uint16_t d, unsigned r, unsigned g,
+                                      unsigned b, unsigned a)
+{
+    unsigned dr = (d >> 11) & 0x1f, dg = (d >> 5) & 0x3f, db = d & 0x1f;
+
+    dr = gr_soft_mix(r, (dr << 3) | (dr >> 2), a);
+    dg = gr_soft_mix(g, (dg << 2) | (dg >> 4), a);
+    db = gr_soft_mix(b, (db << 3) | (db >> 2), a);
+
+    return ((dr >> 3) << 11) | ((dg >> 2) << 5) | (db >> 3);
+}
+
+static inline void gr_soft_blend16(uint8_t *dst, int stride, int w, int h,
+                                   const uint8_t c[4], unsigned a)
+{
+    int x;
+
+    for (; h > 0; h--, dst += stride) {
+        uint16_t *p = (uint16_t *) dst;
+        for (x = 0; x < w; x++)
+            p[x] = gr_soft_mix565(p[x], c[0], c[1], c[2], a);
+    }
+}
+
+/* Draw colour c through an A_8 coverage mask (glyphs). */
+static inline void gr_soft_glyph32(uint8_t *dst, int dstride, const uint8_t *src,
+                                   int sstride, int w, int h, const uint8_t c[4])
+{
+    int x;
+
+    for (; h > 0; h--, dst += dstride, src += sstride) {
+        uint8_t *p = dst;
+        x = 0;
+#ifdef __ARM_NEON__
+        for (; x + 8 <= w; x += 8, p += 32) {
+            uint8x8_t va = vld1_u8(src + x);
+            uint8x8_t via = vmvn_u8(va);
+            uint8x8x4_t d;
+            if (vget_lane_u64(vreinterpret_u64_u8(va), 0) == 0)
+                continue;
+            d = vld4_u8(p);
+            d.val[0] = gr_soft_mix8(vdup_n_u8(c[0]), d.val[0], va, via);
+            d.val[1] = gr_soft_mix8(vdup_n_u8(c[1]), d.val[1], va, via);
+            d.val[2] = gr_soft_mix8(vdup_n_u8(c[2]), d.val[2], va, via);
+            d.val[3] = gr_soft_mix8(vdup_n_u8(c[3]), d.val[3], va, via);
+            vst4_u8(p, d);
+        }
+#endif
+        for (; x < w; x++, p += 4) {
+            unsigned a = src[x];
+            if (a == 0)
+                continue;
+            p[0] = gr_soft_mix(c[0], p[0], a);
+            p[1] = gr_soft_mix(c[1], p[1], a);
+            p[2] = gr_soft_mix(c[2], p[2], a);
+            p[3] = gr_soft_mix(c[3], p[3], a);
+        }
+    }
+}
+
+static inline void gr_soft_glyph16(uint8_t *dst, int dstride, const uint8_t *src,
+                                   int sstride, int w, int h, const uint8_t c[4])
+{
+    int x;
+
+    for (; h > 0; h--, dst += dstride, src += sstride) {
+        uint16_t *p = (uint16_t *) dst;
+        for (x = 0; x < w; x++) {
+            if (src[x])
+                p[x] = gr_soft_mix565(p[x], c[0], c[1], c[2], src[x]);
+        }
+    }
+}
+
+/*
+ * Blend a 32-bit source carrying alpha in byte 3 onto a destination with
+ * the same byte order (RGBA_8888 surfaces onto RGBX_8888). The
+ * destination's fourth byte is left opaque.
+ */
+static inline void gr_soft_blit_alpha32(uint8_t *dst, int dstride, const uint8_t *src,
+                                        int sstride, int w, int h)
+{
+    int x;
+
+    for (; h > 0; h--, dst += dstride, src += sstride) {
+        uint8_t *p = dst;
+        const uint8_t *s = src;
+        x = 0;
+#ifdef __ARM_NEON__
+        for (; x + 8 <= w; x += 8, p += 32, s += 32) {
+            uint8x8x4_t vs = vld4_u8(s);
+            uint8x8x4_t d = vld4_u8(p);
+            uint8x8_t via = vmvn_u8(vs.val[3]);
+            d.val[0] = gr_soft_mix8(vs.val[0], d.val[0], vs.val[3], via);
+            d.val[1] = gr_soft_mix8(vs.val[1], d.val[1], vs.val[3], via);
+            d.val[2] = gr_soft_mix8(vs.val[2], d.val[2], vs.val[3], via);
+            d.val[3] = vdup_n_u8(0xff);
+            vst4_u8(p, d);
+        }
+#endif
+        for (; x < w; x++, p += 4, s += 4) {
+            unsigned a = s[3];
+            p[0] = gr_soft_mix(s[0], p[0], a);
+            p[1] = gr_soft_mix(s[1], p[1], a);
+            p[2] = gr_soft_mix(s[2], p[2], a);
+            p[3] = 0xff;
+        }
+    }
+}
+
+/*
+ * Blend w premultiplied 32-bit pixels (alpha in byte 3) onto one row of
+ * the same byte order: d = s + d * (255 - a) / 255.
+ */
+static inline void gr_soft_blend_pm32(uint8_t *dst, const uint8_t *src, int w)
+{
+    int x = 0;
+
+#ifdef __ARM_NEON__
+    for (; x + 8 <= w; x += 8, dst += 32, src += 32) {
+        uint8x8x4_t vs = vld4_u8(src);
+        uint8x8x4_t d = vld4_u8(dst);
+        uint8x8_t ia = vmvn_u8(vs.val[3]);
+        uint16x8_t t;
+
+        t = vmull_u8(d.val[0], ia);
+        d.val[0] = vqadd_u8(vs.val[0], vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+        t = vmull_u8(d.val[1], ia);
+        d.val[1] = vqadd_u8(vs.val[1], vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+        t = vmull_u8(d.val[2], ia);
+        d.val[2] = vqadd_u8(vs.val[2], vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+        d.val[3] = vdup_n_u8(0xff);
+        vst4_u8(dst, d);
+    }
+#endif
+    for (; x < w; x++, dst += 4, src += 4) {
+        unsigned ia = 255 - src[3];
+        unsigned t;
+
+        t = dst[0] * ia + 128; t = src[0] + ((t + (t >> 8)) >> 8);
+        dst[0] = t > 255 ? 255 : t;
+        t = dst[1] * ia + 128; t = src[1] + ((t + (t >> 8)) >> 8);
+        dst[1] = t > 255 ? 255 : t;
+        t = dst[2] * ia + 128; t = src[2] + ((t + (t >> 8)) >> 8);
+        dst[2] = t > 255 ? 255 : t;
+        dst[3] = 0xff;
+    }
+}
+
+/* Copy h rows of len bytes between surfaces of any stride. */
+static inline void gr_soft_copy(uint8_t *dst, int dstride, const uint8_t *src,
+                                int sstride, int len, int h)
+{
+    int x;
+
+    for (; h > 0; h--, dst += dstride, src += sstride) {
+        x = 0;
+#ifdef __ARM_NEON__
+        for (; x + 64 <= len; x += 64) {
+            uint8x16_t a = vld1q_u8(src + x);
+            uint8x16_t b = vld1q_u8(src + x + 16);
+            uint8x16_t c = vld1q_u8(src + x + 32);
+            uint8x16_t d = vld1q_u8(src + x + 48);
+            __builtin_prefetch(src + x + 256);
+            vst1q_u8(dst + x, a);
+            vst1q_u8(dst + x + 16, b);
+            vst1q_u8(dst + x + 32, c);
+            vst1q_u8(dst + x + 48, d);
+        }
+#endif
+        if (x < len)
+            memcpy(dst + x, src + x, len - x);
+    }
+}
+
+#endif /* _GR_SOFT_H */
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GR_SURFACE_H
+#define _GR_SURFACE_H
+
+#include "minui.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Forget whatever was derived from a surface on its earlier blits. Blits
+ * notice changed pixels on their own; this only frees the converted copy
+ * before the cache would drop it, e.g. when the surface itself is freed.
+ *
+ * @param surface the surface, or NULL for every surface
+ */
+void gr_invalidate_surface(gr_surface surface);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _GR_SURFACE_H
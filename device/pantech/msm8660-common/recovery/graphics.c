@@ -18,11 +18,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -37,6 +42,9 @@
 #endif
 
 #include "minui.h"
+#include "gr_frame.h"
+#include "gr_backend.h"
+#include "gr_surface.h"
 
 #if defined(RECOVERY_BGRA)
 #define PIXEL_FORMAT GGL_PIXEL_FORMAT_BGRA_8888
@@ -49,21 +57,147 @@
 #define PIXEL_SIZE   2
 #endif
 
-#define NUM_BUFFERS 2
+/*
+ * Up to NUM_BUFFERS framebuffer pages are used. Drawing goes to
+ * gr_mem_surface and gr_flip copies the damaged rows into the next page
+ * before panning to it. With three pages that page was last shown two
+ * flips ago, so the copy never lands on a page a pan may still be leaving.
+ */
+#define NUM_BUFFERS 3
+
+/*
+ * gr_flip pans at most once per vblank: it waits on FBIO_WAITFORVSYNC
+ * when the driver has it, otherwise on a timerfd ticking at REFRESH_RATE.
+ */
+#ifndef REFRESH_RATE
+#define REFRESH_RATE 60
+#endif
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, uint32_t)
+#endif
+
+/*
+ * RECOVERY_SOFT_RASTER draws fills, text and same-format blits straight
+ * into gr_mem_surface with the kernels in gr_soft.h instead of going
+ * through pixelflinger, which remains the fallback for anything else.
+ */
+#ifdef RECOVERY_SOFT_RASTER
+#include "gr_soft.h"
+#endif
+
+/*
+ * The font strip doubles as the glyph atlas: glyph i (code point i + 32)
+ * sits at x = i * cwidth. Each glyph records where its ink starts and how
+ * wide it is, so blank columns (and blank glyphs) are never drawn.
+ * RECOVERY_PROPORTIONAL_FONT advances by the ink width instead of cwidth.
+ */
+#define GR_NUM_GLYPHS 96
+#define GR_GLYPH_FALLBACK ('?' - 32)
+
+typedef struct {
+    unsigned short sx;
+    unsigned char left;
+    unsigned char width;
+    unsigned char advance;
+} GRGlyph;
 
 typedef struct {
     GGLSurface texture;
     unsigned cwidth;
     unsigned cheight;
     unsigned ascent;
+    GRGlyph glyphs[GR_NUM_GLYPHS];
 } GRFont;
 
+/*
+ * Laid out lines are kept in a small round-robin cache keyed by the UTF-8
+ * text, since recovery redraws the same menu and log lines over and over.
+ */
+#define GR_LAYOUT_CACHE 32
+#define GR_LAYOUT_MAX 128
+
+typedef struct {
+    unsigned hash;
+    unsigned len;
+    char text[GR_LAYOUT_MAX];
+    int count;
+    int width;
+    unsigned char glyph[GR_LAYOUT_MAX];
+    short x[GR_LAYOUT_MAX];
+} GRLayout;
+
+static GRLayout gr_layouts[GR_LAYOUT_CACHE];
+static unsigned gr_layout_next = 0;
+
 static GRFont *gr_font = 0;
 static GGLContext *gr_context = 0;
 static GGLSurface gr_font_texture;
 static GGLSurface gr_framebuffer[NUM_BUFFERS];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
+static unsigned gr_num_buffers = 2;
+static int gr_fb_panned = 0;
+
+static int gr_vsync_ioctl = 0;
+static int gr_vsync_timer_fd = -1;
+
+static GRStats gr_stats;
+
+static unsigned gr_headless_width = 480;
+static unsigned gr_headless_height = 800;
+static unsigned gr_headless_pages = NUM_BUFFERS;
+static void *gr_headless_bits = NULL;
+
+static pthread_mutex_t gr_frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gr_frame_cond = PTHREAD_COND_INITIALIZER;
+static int gr_frame_dirty = 0;
+
+/* Rows [y1, y2) of each framebuffer that are out of date with respect to
+ * gr_mem_surface. Drawing marks all buffers, a flip clears the buffer it
+ * brings up to date. */
+typedef struct {
+    int y1;
+    int y2;
+} GRDamage;
+
+static GRDamage gr_damage[NUM_BUFFERS];
+
+#ifdef RECOVERY_SOFT_RASTER
+/* current colour as r, g, b, a and in framebuffer byte order */
+static unsigned char gr_rgba[4];
+static unsigned char gr_pixel_bytes[4];
+static uint16_t gr_pixel_565;
+
+/*
+ * Clip a w x h copy from (*sx, *sy) in a sw x sh source to (*dx, *dy) on
+ * the memory surface. Returns 0 when nothing is left to draw.
+ */
+static int gr_soft_clip(int *sx, int *sy, int sw, int sh,
+                        int *dx, int *dy, int *w, int *h)
+{
+    int d;
+
+    if (*sx < 0) { *dx -= *sx; *w += *sx; *sx = 0; }
+    if (*sy < 0) { *dy -= *sy; *h += *sy; *sy = 0; }
+    if (*dx < 0) { *sx -= *dx; *w += *dx; *dx = 0; }
+    if (*dy < 0) { *sy -= *dy; *h += *dy; *dy = 0; }
+    if ((d = *sx + *w - sw) > 0) *w -= d;
+    if ((d = *sy + *h - sh) > 0) *h -= d;
+    if ((d = *dx + *w - (int) gr_mem_surface.width) > 0) *w -= d;
+    if ((d = *dy + *h - (int) gr_mem_surface.height) > 0) *h -= d;
+
+    return *w > 0 && *h > 0;
+}
+
+static inline uint8_t *gr_soft_pixel(GGLSurface *s, int x, int y)
+{
+    unsigned bpp = s->format == GGL_PIXEL_FORMAT_A_8 ? 1 :
+                   s->format == GGL_PIXEL_FORMAT_RGB_565 ? 2 : 4;
+
+    return (uint8_t *) s->data + (y * s->stride + x) * bpp;
+}
+#endif
 
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
@@ -75,6 +209,7 @@ static int get_framebuffer(GGLSurface *fb)
 {
     int fd;
     void *bits;
+    unsigned i;
 
     fd = open("/dev/graphics/fb0", O_RDWR);
     if (fd < 0) {
@@ -136,23 +271,21 @@ static int get_framebuffer(GGLSurface *fb)
         return -1;
     }
 
-    fb->version = sizeof(*fb);
-    fb->width = vi.xres;
-    fb->height = vi.yres;
-    fb->stride = fi.line_length/PIXEL_SIZE;
-    fb->data = bits;
-    fb->format = PIXEL_FORMAT;
-    memset(fb->data, 0, vi.yres * fi.line_length);
-
-    fb++;
-
-    fb->version = sizeof(*fb);
-    fb->width = vi.xres;
-    fb->height = vi.yres;
-    fb->stride = fi.line_length/PIXEL_SIZE;
-    fb->data = (void*) (((unsigned) bits) + vi.yres * fi.line_length);
-    fb->format = PIXEL_FORMAT;
-    memset(fb->data, 0, vi.yres * fi.line_length);
+    gr_num_buffers = fi.smem_len / (vi.yres * fi.line_length);
+    if (gr_num_buffers > NUM_BUFFERS)
+        gr_num_buffers = NUM_BUFFERS;
+    if (gr_num_buffers < 2)
+        gr_num_buffers = 2;
+
+    for (i = 0; i < gr_num_buffers; i++, fb++) {
+        fb->version = sizeof(*fb);
+        fb->width = vi.xres;
+        fb->height = vi.yres;
+        fb->stride = fi.line_length/PIXEL_SIZE;
+        fb->data = (void*) (((unsigned) bits) + i * vi.yres * fi.line_length);
+        fb->format = PIXEL_FORMAT;
+        memset(fb->data, 0, vi.yres * fi.line_length);
+    }
 
     return fd;
 }
@@ -168,29 +301,316 @@ static void get_memory_surface(GGLSurface* ms) {
 
 static void set_active_framebuffer(unsigned n)
 {
-    if (n > 1) return;
-    vi.yres_virtual = vi.yres * NUM_BUFFERS;
+    if (n >= gr_num_buffers) return;
+    vi.yres_virtual = vi.yres * gr_num_buffers;
     vi.yoffset = n * vi.yres;
     vi.bits_per_pixel = PIXEL_SIZE * 8;
+    /* Once the virtual size is set, only move the scanout; fall back to a
+     * full mode set if the driver refuses to pan. */
+    if (gr_fb_panned && ioctl(gr_fb_fd, FBIOPAN_DISPLAY, &vi) == 0)
+        return;
     if (ioctl(gr_fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
         perror("active fb swap failed");
+        return;
+    }
+    gr_fb_panned = 1;
+}
+
+static void gr_vsync_init(void)
+{
+    struct itimerspec period;
+    uint32_t crtc = 0;
+
+    if (ioctl(gr_fb_fd, FBIO_WAITFORVSYNC, &crtc) == 0) {
+        gr_vsync_ioctl = 1;
+        return;
+    }
+
+    gr_vsync_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (gr_vsync_timer_fd < 0) {
+        perror("can't create vsync timer");
+        return;
+    }
+
+    period.it_interval.tv_sec = 0;
+    period.it_interval.tv_nsec = 1000000000 / REFRESH_RATE;
+    period.it_value = period.it_interval;
+    if (timerfd_settime(gr_vsync_timer_fd, 0, &period, NULL) < 0) {
+        perror("can't start vsync timer");
+        close(gr_vsync_timer_fd);
+        gr_vsync_timer_fd = -1;
+    }
+}
+
+/*
+ * Block until the next vblank. With the timer, a tick that already
+ * expired since the previous flip lets this one through at once, so an
+ * idle UI pays no latency while back-to-back flips are held to one per
+ * period.
+ */
+static void gr_vsync_wait(void)
+{
+    uint32_t crtc = 0;
+    uint64_t ticks;
+
+    if (gr_vsync_ioctl) {
+        if (ioctl(gr_fb_fd, FBIO_WAITFORVSYNC, &crtc) == 0)
+            return;
+        perror("FBIO_WAITFORVSYNC failed");
+        gr_vsync_ioctl = 0;
+        gr_vsync_init();
+    }
+
+    if (gr_vsync_timer_fd >= 0) {
+        while (read(gr_vsync_timer_fd, &ticks, sizeof(ticks)) < 0 &&
+               errno == EINTR)
+            ;
+    }
+}
+
+void gr_frame_request(void)
+{
+    pthread_mutex_lock(&gr_frame_lock);
+    gr_frame_dirty = 1;
+    pthread_cond_signal(&gr_frame_cond);
+    pthread_mutex_unlock(&gr_frame_lock);
+}
+
+int gr_frame_wait(int timeout_ms)
+{
+    int dirty;
+
+    pthread_mutex_lock(&gr_frame_lock);
+    if (timeout_ms < 0) {
+        while (!gr_frame_dirty)
+            pthread_cond_wait(&gr_frame_cond, &gr_frame_lock);
+    } else if (!gr_frame_dirty && timeout_ms > 0) {
+        struct timespec ts;
+
+#ifdef HAVE_PTHREAD_COND_TIMEDWAIT_RELATIVE
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        pthread_cond_timedwait_relative_np(&gr_frame_cond, &gr_frame_lock,
+                                           &ts);
+#else
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ts.tv_sec++;
+        }
+        pthread_cond_timedwait(&gr_frame_cond, &gr_frame_lock, &ts);
+#endif
+    }
+    dirty = gr_frame_dirty;
+    gr_frame_dirty = 0;
+    pthread_mutex_unlock(&gr_frame_lock);
+
+    return dirty;
+}
+
+/*
+ * A backend provides the framebuffer pages and puts one of them on screen.
+ * open fills in vi, fi and gr_num_buffers along with the page surfaces,
+ * and returns a negative value on failure.
+ */
+typedef struct {
+    const char *name;
+    int (*open)(GGLSurface *fb);
+    void (*pan)(unsigned n);
+    void (*vsync)(void);
+    void (*blank)(bool blank);
+    void (*close)(void);
+} GRBackend;
+
+static int fbdev_open(GGLSurface *fb)
+{
+    gr_vt_fd = open("/dev/tty0", O_RDWR | O_SYNC);
+    if (gr_vt_fd < 0) {
+        // This is non-fatal; post-Cupcake kernels don't have tty0.
+        perror("can't open /dev/tty0");
+    } else if (ioctl(gr_vt_fd, KDSETMODE, (void*) KD_GRAPHICS)) {
+        // However, if we do open tty0, we expect the ioctl to work.
+        perror("failed KDSETMODE to KD_GRAPHICS on tty0");
+        return -1;
+    }
+
+    gr_fb_fd = get_framebuffer(fb);
+    if (gr_fb_fd < 0)
+        return -1;
+
+    gr_vsync_init();
+    return 0;
+}
+
+static void fbdev_blank(bool blank)
+{
+    int ret;
+
+    ret = ioctl(gr_fb_fd, FBIOBLANK, blank ? FB_BLANK_POWERDOWN : FB_BLANK_UNBLANK);
+    if (ret < 0)
+        perror("ioctl(): blank");
+}
+
+static void fbdev_close(void)
+{
+    close(gr_fb_fd);
+    gr_fb_fd = -1;
+
+    if (gr_vsync_timer_fd >= 0) {
+        close(gr_vsync_timer_fd);
+        gr_vsync_timer_fd = -1;
+    }
+    gr_vsync_ioctl = 0;
+
+    ioctl(gr_vt_fd, KDSETMODE, (void*) KD_TEXT);
+    close(gr_vt_fd);
+    gr_vt_fd = -1;
+}
+
+static const GRBackend gr_backend_fbdev = {
+    .name = "fbdev",
+    .open = fbdev_open,
+    .pan = set_active_framebuffer,
+    .vsync = gr_vsync_wait,
+    .blank = fbdev_blank,
+    .close = fbdev_close,
+};
+
+/* Pages in plain memory; nothing is ever shown and flips never wait. */
+static int headless_open(GGLSurface *fb)
+{
+    size_t page;
+    unsigned i;
+
+    memset(&vi, 0, sizeof(vi));
+    memset(&fi, 0, sizeof(fi));
+    vi.xres = vi.xres_virtual = gr_headless_width;
+    vi.yres = gr_headless_height;
+    vi.yres_virtual = gr_headless_height * gr_headless_pages;
+    vi.bits_per_pixel = PIXEL_SIZE * 8;
+    fi.line_length = gr_headless_width * PIXEL_SIZE;
+
+    page = vi.yres * fi.line_length;
+    fi.smem_len = page * gr_headless_pages;
+    gr_headless_bits = mmap(NULL, fi.smem_len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (gr_headless_bits == MAP_FAILED) {
+        perror("failed to map headless framebuffer");
+        gr_headless_bits = NULL;
+        return -1;
+    }
+
+    gr_num_buffers = gr_headless_pages;
+
+    for (i = 0; i < gr_num_buffers; i++, fb++) {
+        fb->version = sizeof(*fb);
+        fb->width = vi.xres;
+        fb->height = vi.yres;
+        fb->stride = gr_headless_width;
+        fb->data = (uint8_t*) gr_headless_bits + i * page;
+        fb->format = PIXEL_FORMAT;
+    }
+
+    return 0;
+}
+
+static void headless_pan(unsigned n)
+{
+    vi.yoffset = n * vi.yres;
+}
+
+static void headless_vsync(void)
+{
+}
+
+static void headless_blank(bool blank)
+{
+}
+
+static void headless_close(void)
+{
+    if (gr_headless_bits != NULL)
+        munmap(gr_headless_bits, fi.smem_len);
+    gr_headless_bits = NULL;
+}
+
+static const GRBackend gr_backend_headless = {
+    .name = "headless",
+    .open = headless_open,
+    .pan = headless_pan,
+    .vsync = headless_vsync,
+    .blank = headless_blank,
+    .close = headless_close,
+};
+
+static const GRBackend *gr_backend = &gr_backend_fbdev;
+
+int gr_use_headless(unsigned width, unsigned height, unsigned pages)
+{
+    if (gr_context != NULL || width == 0 || height == 0 ||
+        pages < 2 || pages > NUM_BUFFERS)
+        return -1;
+
+    gr_headless_width = width;
+    gr_headless_height = height;
+    gr_headless_pages = pages;
+    gr_backend = &gr_backend_headless;
+    return 0;
+}
+
+void gr_get_stats(GRStats *stats)
+{
+    *stats = gr_stats;
+}
+
+void gr_reset_stats(void)
+{
+    memset(&gr_stats, 0, sizeof(gr_stats));
+}
+
+static void gr_add_damage(int y1, int y2)
+{
+    unsigned i;
+
+    if (y1 < 0) y1 = 0;
+    if (y2 > (int) vi.yres) y2 = vi.yres;
+    if (y1 >= y2) return;
+
+    for (i = 0; i < gr_num_buffers; i++) {
+        if (gr_damage[i].y1 >= gr_damage[i].y2) {
+            gr_damage[i].y1 = y1;
+            gr_damage[i].y2 = y2;
+        } else {
+            if (y1 < gr_damage[i].y1) gr_damage[i].y1 = y1;
+            if (y2 > gr_damage[i].y2) gr_damage[i].y2 = y2;
+        }
     }
 }
 
 void gr_flip(void)
 {
-    GGLContext *gl = gr_context;
+    GRDamage *d;
 
     /* swap front and back buffers */
-    gr_active_fb = (gr_active_fb + 1) & 1;
-
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           fi.line_length * vi.yres);
+    gr_active_fb = (gr_active_fb + 1) % gr_num_buffers;
+
+    /* copy the rows that changed since this buffer was last shown from
+     * the in-memory surface to the buffer we're about to make active. */
+    d = &gr_damage[gr_active_fb];
+    if (d->y1 < d->y2) {
+        memcpy((char*) gr_framebuffer[gr_active_fb].data + d->y1 * fi.line_length,
+               (char*) gr_mem_surface.data + d->y1 * fi.line_length,
+               (d->y2 - d->y1) * fi.line_length);
+        gr_stats.bytes_copied += (d->y2 - d->y1) * fi.line_length;
+        d->y1 = d->y2 = 0;
+    }
 
     /* inform the display driver */
-    set_active_framebuffer(gr_active_fb);
+    gr_backend->vsync();
+    gr_backend->pan(gr_active_fb);
+    gr_stats.flips++;
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -202,11 +622,136 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+
+#ifdef RECOVERY_SOFT_RASTER
+    gr_rgba[0] = r;
+    gr_rgba[1] = g;
+    gr_rgba[2] = b;
+    gr_rgba[3] = a;
+    if (PIXEL_FORMAT == GGL_PIXEL_FORMAT_BGRA_8888) {
+        gr_pixel_bytes[0] = b;
+        gr_pixel_bytes[1] = g;
+        gr_pixel_bytes[2] = r;
+    } else {
+        gr_pixel_bytes[0] = r;
+        gr_pixel_bytes[1] = g;
+        gr_pixel_bytes[2] = b;
+    }
+    gr_pixel_bytes[3] = 0xff;
+    gr_pixel_565 = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+#endif
+}
+
+/* Decode one UTF-8 sequence, returning U+FFFD for malformed input. */
+static unsigned gr_utf8_next(const char **ps)
+{
+    const unsigned char *s = (const unsigned char *) *ps;
+    unsigned c = *s++, n, min;
+
+    if (c < 0x80) {
+        *ps = (const char *) s;
+        return c;
+    } else if ((c & 0xe0) == 0xc0) {
+        n = 1; c &= 0x1f; min = 0x80;
+    } else if ((c & 0xf0) == 0xe0) {
+        n = 2; c &= 0x0f; min = 0x800;
+    } else if ((c & 0xf8) == 0xf0) {
+        n = 3; c &= 0x07; min = 0x10000;
+    } else {
+        *ps = (const char *) s;
+        return 0xfffd;
+    }
+
+    while (n--) {
+        if ((*s & 0xc0) != 0x80) {
+            *ps = (const char *) s;
+            return 0xfffd;
+        }
+        c = (c << 6) | (*s++ & 0x3f);
+    }
+
+    *ps = (const char *) s;
+    return c < min ? 0xfffd : c;
+}
+
+/*
+ * Lay out up to GR_LAYOUT_MAX glyphs of s into l. Returns the part of s
+ * that did not fit.
+ */
+static const char *gr_layout_text(const char *s, GRLayout *l)
+{
+    GRFont *font = gr_font;
+    unsigned c, g;
+    int x = 0;
+
+    l->count = 0;
+    while (*s && l->count < GR_LAYOUT_MAX) {
+        c = gr_utf8_next(&s);
+        if (c < 32) {
+            /* control characters take a cell but draw nothing */
+            x += font->cwidth;
+            continue;
+        }
+        g = c - 32;
+        if (g >= GR_NUM_GLYPHS)
+            g = GR_GLYPH_FALLBACK;
+
+        l->glyph[l->count] = g;
+        l->x[l->count] = x;
+        l->count++;
+        x += font->glyphs[g].advance;
+    }
+    l->width = x;
+
+    return s;
+}
+
+/* Returns the cached layout of s, or NULL if s is too long to cache. */
+static GRLayout *gr_layout_lookup(const char *s)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    unsigned hash = 5381, len = 0, i;
+    GRLayout *l;
+
+    while (*p) {
+        hash = hash * 33 + *p++;
+        len++;
+    }
+    if (len >= GR_LAYOUT_MAX)
+        return NULL;
+
+    for (i = 0; i < GR_LAYOUT_CACHE; i++) {
+        l = &gr_layouts[i];
+        if (l->hash == hash && l->len == len && memcmp(l->text, s, len) == 0)
+            return l;
+    }
+
+    l = &gr_layouts[gr_layout_next];
+    gr_layout_next = (gr_layout_next + 1) % GR_LAYOUT_CACHE;
+
+    l->hash = hash;
+    l->len = len;
+    memcpy(l->text, s, len + 1);
+    gr_layout_text(s, l);
+
+    return l;
 }
 
 int gr_measure(const char *s)
 {
-    return gr_font->cwidth * strlen(s);
+    GRLayout *l = gr_layout_lookup(s);
+    GRLayout tmp;
+    int width = 0;
+
+    if (l != NULL)
+        return l->width;
+
+    while (*s) {
+        s = gr_layout_text(s, &tmp);
+        width += tmp.width;
+    }
+
+    return width;
 }
 
 void gr_font_size(int *x, int *y)
@@ -215,27 +760,105 @@ void gr_font_size(int *x, int *y)
     *y = gr_font->cheight;
 }
 
+/* Draw one laid out run with its top left corner at x, y. */
+static void gr_text_run(int x, int y, const GRLayout *l)
+{
+    GRFont *font = gr_font;
+    const GRGlyph *g;
+    int i;
+
+#ifdef RECOVERY_SOFT_RASTER
+    {
+        int row, y1 = y, y2 = y + font->cheight;
+        const uint8_t *src;
+        uint8_t *dst;
+
+        if (y1 < 0) y1 = 0;
+        if (y2 > (int) gr_mem_surface.height) y2 = gr_mem_surface.height;
+
+        /* Walk the destination a row at a time across the whole run so
+         * framebuffer writes stay sequential. */
+        for (row = y1; row < y2; row++) {
+            dst = gr_soft_pixel(&gr_mem_surface, 0, row);
+            src = (const uint8_t *) font->texture.data +
+                  (row - y) * font->texture.stride;
+
+            for (i = 0; i < l->count; i++) {
+                int dx, sx, w;
+
+                g = &font->glyphs[l->glyph[i]];
+                if (g->width == 0)
+                    continue;
+
+                dx = x + l->x[i] + g->left;
+                sx = g->sx;
+                w = g->width;
+                if (dx < 0) { sx -= dx; w += dx; dx = 0; }
+                if (dx + w > (int) gr_mem_surface.width) w = gr_mem_surface.width - dx;
+                if (w <= 0)
+                    continue;
+
+                if (PIXEL_SIZE == 4)
+                    gr_soft_glyph32(dst + dx * 4, 0, src + sx, 0, w, 1,
+                                    gr_pixel_bytes);
+                else
+                    gr_soft_glyph16(dst + dx * 2, 0, src + sx, 0, w, 1,
+                                    gr_rgba);
+            }
+        }
+        return;
+    }
+#else
+    {
+        GGLContext *gl = gr_context;
+
+        for (i = 0; i < l->count; i++) {
+            int dx;
+
+            g = &font->glyphs[l->glyph[i]];
+            if (g->width == 0)
+                continue;
+
+            dx = x + l->x[i] + g->left;
+            gl->texCoord2i(gl, g->sx - dx, 0 - y);
+            gl->recti(gl, dx, y, dx + g->width, y + font->cheight);
+        }
+    }
+#endif
+}
+
 int gr_text(int x, int y, const char *s)
 {
-    GGLContext *gl = gr_context;
     GRFont *font = gr_font;
-    unsigned off;
+    GRLayout *l;
+    GRLayout tmp;
 
     y -= font->ascent;
 
-    gl->bindTexture(gl, &font->texture);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
+    gr_add_damage(y, y + font->cheight);
 
-    while((off = *s++)) {
-        off -= 32;
-        if (off < 96) {
-            gl->texCoord2i(gl, (off * font->cwidth) - x, 0 - y);
-            gl->recti(gl, x, y, x + font->cwidth, y + font->cheight);
-        }
-        x += font->cwidth;
+#ifndef RECOVERY_SOFT_RASTER
+    {
+        GGLContext *gl = gr_context;
+
+        gl->bindTexture(gl, &font->texture);
+        gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+        gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+        gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+        gl->enable(gl, GGL_TEXTURE_2D);
+    }
+#endif
+
+    l = gr_layout_lookup(s);
+    if (l != NULL) {
+        gr_text_run(x, y, l);
+        return x + l->width;
+    }
+
+    while (*s) {
+        s = gr_layout_text(s, &tmp);
+        gr_text_run(x, y, &tmp);
+        x += tmp.width;
     }
 
     return x;
@@ -244,16 +867,289 @@ int gr_text(int x, int y, const char *s)
 void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+    /* x, y, w, h are really the left, top, right and bottom edges */
+    gr_add_damage(y, h);
+
+#ifdef RECOVERY_SOFT_RASTER
+    {
+        int sx = x, sy = y, dx = x, dy = y;
+        uint8_t *dst;
+
+        w -= x;
+        h -= y;
+        if (!gr_soft_clip(&sx, &sy, gr_mem_surface.width, gr_mem_surface.height,
+                          &dx, &dy, &w, &h) || gr_rgba[3] == 0)
+            return;
+
+        dst = gr_soft_pixel(&gr_mem_surface, dx, dy);
+        if (PIXEL_SIZE == 4) {
+            if (gr_rgba[3] == 0xff)
+                gr_soft_fill32(dst, fi.line_length, w, h, gr_pixel_bytes);
+            else
+                gr_soft_blend32(dst, fi.line_length, w, h, gr_pixel_bytes,
+                                gr_rgba[3]);
+        } else {
+            if (gr_rgba[3] == 0xff)
+                gr_soft_fill16(dst, fi.line_length, w, h, gr_pixel_565);
+            else
+                gr_soft_blend16(dst, fi.line_length, w, h, gr_rgba, gr_rgba[3]);
+        }
+        return;
+    }
+#endif
+
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x, y, w, h);
 }
 
+#ifdef RECOVERY_SOFT_RASTER
+/*
+ * Image surfaces (recovery icons, charger battery frames) are converted
+ * once, on their first blit, into the framebuffer's byte order with
+ * premultiplied alpha. Images with transparency also get per-row spans of
+ * opaque and translucent pixels, so fully transparent areas cost nothing
+ * and opaque runs are plain copies. Only 32-bit framebuffers are cached.
+ * An entry is reused while its surface's address, data, size and a
+ * checksum of its pixels still match, so a surface freed and allocated
+ * again at the same address, or edited in place, is converted afresh.
+ */
+#define GR_ASSET_CACHE 32
+#define GR_SPAN_BLEND 0x8000
+
+typedef struct {
+    unsigned short x;
+    unsigned short len;     /* | GR_SPAN_BLEND for translucent runs */
+} GRSpan;
+
+typedef struct {
+    GGLSurface *src;
+    void *src_data;
+    unsigned width;
+    unsigned height;
+    uint64_t sum;
+    int opaque;
+    uint8_t *pixels;
+    GRSpan *spans;          /* NULL: blend whole rows */
+    unsigned *row_spans;    /* height + 1 offsets into spans */
+} GRAsset;
+
+static GRAsset gr_assets[GR_ASSET_CACHE];
+static unsigned gr_asset_next = 0;
+
+static void gr_asset_free(GRAsset *a)
+{
+    free(a->pixels);
+    free(a->spans);
+    free(a->row_spans);
+    memset(a, 0, sizeof(*a));
+}
+
+static void gr_asset_build_spans(GRAsset *a)
+{
+    unsigned x, y, n = 0, max = a->width * a->height / 16 + a->height;
+    const uint8_t *p;
+
+    a->spans = malloc(max * sizeof(GRSpan));
+    a->row_spans = malloc((a->height + 1) * sizeof(unsigned));
+    if (a->spans == NULL || a->row_spans == NULL)
+        goto fail;
+
+    for (y = 0; y < a->height; y++) {
+        a->row_spans[y] = n;
+        p = a->pixels + y * a->width * 4;
+        for (x = 0; x < a->width; ) {
+            unsigned start = x, blend;
+
+            if (p[x * 4 + 3] == 0) {
+                x++;
+                continue;
+            }
+            blend = p[x * 4 + 3] != 0xff;
+            while (x < a->width && p[x * 4 + 3] != 0 &&
+                   (p[x * 4 + 3] != 0xff) == blend)
+                x++;
+
+            /* too fragmented to be worth it, blend whole rows instead */
+            if (n == max)
+                goto fail;
+            a->spans[n].x = start;
+            a->spans[n].len = (x - start) | (blend ? GR_SPAN_BLEND : 0);
+            n++;
+        }
+    }
+    a->row_spans[a->height] = n;
+    return;
+
+fail:
+    free(a->spans);
+    free(a->row_spans);
+    a->spans = NULL;
+    a->row_spans = NULL;
+}
+
+/*
+ * Fletcher-style sum of every pixel of a 32-bit surface. It is one add
+ * pair per pixel, much less than converting the surface again.
+ */
+static uint64_t gr_asset_sum(GGLSurface *src)
+{
+    uint32_t lo = 0, hi = 0;
+    unsigned x, y;
+
+    for (y = 0; y < src->height; y++) {
+        const uint32_t *p = (const uint32_t *) src->data + y * src->stride;
+
+        for (x = 0; x < src->width; x++) {
+            lo += p[x];
+            hi += lo;
+        }
+    }
+    return (uint64_t) hi << 32 | lo;
+}
+
+static GRAsset *gr_asset_get(GGLSurface *src)
+{
+    GRAsset *a;
+    unsigned i, x, y;
+    uint64_t sum;
+    int has_alpha;
+
+    if (PIXEL_SIZE != 4 || src->width > 0x7fff ||
+        (src->format != GGL_PIXEL_FORMAT_RGBX_8888 &&
+         src->format != GGL_PIXEL_FORMAT_RGBA_8888))
+        return NULL;
+    if (src->width == 0 || src->height == 0)
+        return NULL;
+
+    sum = gr_asset_sum(src);
+    for (i = 0; i < GR_ASSET_CACHE; i++) {
+        a = &gr_assets[i];
+        if (a->src == src && a->src_data == src->data &&
+            a->width == src->width && a->height == src->height &&
+            a->sum == sum)
+            return a;
+    }
+
+    a = &gr_assets[gr_asset_next];
+    gr_asset_next = (gr_asset_next + 1) % GR_ASSET_CACHE;
+    gr_asset_free(a);
+
+    a->pixels = malloc(src->width * src->height * 4);
+    if (a->pixels == NULL)
+        return NULL;
+
+    has_alpha = src->format == GGL_PIXEL_FORMAT_RGBA_8888;
+    a->opaque = 1;
+    for (y = 0; y < src->height; y++) {
+        const uint8_t *s = (const uint8_t *) src->data + y * src->stride * 4;
+        uint8_t *d = a->pixels + y * src->width * 4;
+
+        for (x = 0; x < src->width; x++, s += 4, d += 4) {
+            unsigned al = has_alpha ? s[3] : 0xff;
+            unsigned r = s[0], g = s[1], b = s[2];
+
+            if (al != 0xff) {
+                a->opaque = 0;
+                r = gr_soft_mix(r, 0, al);
+                g = gr_soft_mix(g, 0, al);
+                b = gr_soft_mix(b, 0, al);
+            }
+            if (PIXEL_FORMAT == GGL_PIXEL_FORMAT_BGRA_8888) {
+                d[0] = b; d[1] = g; d[2] = r;
+            } else {
+                d[0] = r; d[1] = g; d[2] = b;
+            }
+            d[3] = al;
+        }
+    }
+
+    a->src = src;
+    a->src_data = src->data;
+    a->width = src->width;
+    a->height = src->height;
+    a->sum = sum;
+    if (!a->opaque)
+        gr_asset_build_spans(a);
+
+    return a;
+}
+
+static void gr_asset_blit(GRAsset *a, int sx, int sy, int w, int h,
+                          int dx, int dy)
+{
+    const uint8_t *src = a->pixels + (sy * a->width + sx) * 4;
+    uint8_t *dst = gr_soft_pixel(&gr_mem_surface, dx, dy);
+    int y;
+
+    if (a->opaque) {
+        gr_soft_copy(dst, fi.line_length, src, a->width * 4, w * 4, h);
+        return;
+    }
+
+    for (y = 0; y < h; y++, src += a->width * 4, dst += fi.line_length) {
+        const GRSpan *span, *end;
+
+        if (a->spans == NULL) {
+            gr_soft_blend_pm32(dst, src, w);
+            continue;
+        }
+
+        span = a->spans + a->row_spans[sy + y];
+        end = a->spans + a->row_spans[sy + y + 1];
+        for (; span < end; span++) {
+            int x1 = span->x - sx;
+            int x2 = x1 + (span->len & ~GR_SPAN_BLEND);
+
+            if (x1 < 0) x1 = 0;
+            if (x2 > w) x2 = w;
+            if (x1 >= x2)
+                continue;
+
+            if (span->len & GR_SPAN_BLEND)
+                gr_soft_blend_pm32(dst + x1 * 4, src + x1 * 4, x2 - x1);
+            else
+                memcpy(dst + x1 * 4, src + x1 * 4, (x2 - x1) * 4);
+        }
+    }
+}
+#endif
+
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     if (gr_context == NULL) {
         return;
     }
     GGLContext *gl = gr_context;
 
+    gr_add_damage(dy, dy + h);
+
+#ifdef RECOVERY_SOFT_RASTER
+    {
+        GGLSurface *src = (GGLSurface*) source;
+        GRAsset *asset = gr_asset_get(src);
+        int opaque = src->format == PIXEL_FORMAT;
+        int alpha = PIXEL_FORMAT == GGL_PIXEL_FORMAT_RGBX_8888 &&
+                    src->format == GGL_PIXEL_FORMAT_RGBA_8888;
+
+        if (asset != NULL || opaque || alpha) {
+            if (!gr_soft_clip(&sx, &sy, src->width, src->height,
+                              &dx, &dy, &w, &h))
+                return;
+
+            if (asset != NULL)
+                gr_asset_blit(asset, sx, sy, w, h, dx, dy);
+            else if (opaque)
+                gr_soft_copy(gr_soft_pixel(&gr_mem_surface, dx, dy),
+                             fi.line_length, gr_soft_pixel(src, sx, sy),
+                             src->stride * PIXEL_SIZE, w * PIXEL_SIZE, h);
+            else
+                gr_soft_blit_alpha32(gr_soft_pixel(&gr_mem_surface, dx, dy),
+                                     fi.line_length, gr_soft_pixel(src, sx, sy),
+                                     src->stride * 4, w, h);
+            return;
+        }
+    }
+#endif
+
     gl->bindTexture(gl, (GGLSurface*) source);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -282,6 +1178,7 @@ static void gr_init_font(void)
     GGLSurface *ftex;
     unsigned char *bits, *rle;
     unsigned char *in, data;
+    unsigned i;
 
     gr_font = calloc(sizeof(*gr_font), 1);
     ftex = &gr_font->texture;
@@ -304,6 +1201,34 @@ static void gr_init_font(void)
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
+
+    /* find the ink columns of every glyph */
+    for (i = 0; i < GR_NUM_GLYPHS; i++) {
+        GRGlyph *g = &gr_font->glyphs[i];
+        unsigned x, y, first = font.cwidth, last = 0;
+        unsigned char *col = (unsigned char *) ftex->data + i * font.cwidth;
+
+        for (x = 0; x < font.cwidth && (i + 1) * font.cwidth <= font.width; x++) {
+            for (y = 0; y < font.cheight; y++) {
+                if (col[y * ftex->stride + x]) {
+                    if (x < first) first = x;
+                    last = x;
+                    break;
+                }
+            }
+        }
+
+        if (first < font.cwidth) {
+            g->left = first;
+            g->width = last - first + 1;
+            g->sx = i * font.cwidth + first;
+        }
+#ifdef RECOVERY_PROPORTIONAL_FONT
+        g->advance = g->width ? (unsigned) g->width + 1 : font.cwidth / 2;
+#else
+        g->advance = font.cwidth;
+#endif
+    }
 }
 
 int gr_init(void)
@@ -312,31 +1237,22 @@ int gr_init(void)
     GGLContext *gl = gr_context;
 
     gr_init_font();
-    gr_vt_fd = open("/dev/tty0", O_RDWR | O_SYNC);
-    if (gr_vt_fd < 0) {
-        // This is non-fatal; post-Cupcake kernels don't have tty0.
-        perror("can't open /dev/tty0");
-    } else if (ioctl(gr_vt_fd, KDSETMODE, (void*) KD_GRAPHICS)) {
-        // However, if we do open tty0, we expect the ioctl to work.
-        perror("failed KDSETMODE to KD_GRAPHICS on tty0");
-        gr_exit();
-        return -1;
-    }
 
-    gr_fb_fd = get_framebuffer(gr_framebuffer);
-    if (gr_fb_fd < 0) {
+    if (gr_backend->open(gr_framebuffer) < 0) {
         gr_exit();
         return -1;
     }
 
-    get_memory_surface(&gr_mem_surface);
-
-    fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
-            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
+    fprintf(stderr, "framebuffer: %s (%d x %d), %u pages\n",
+            gr_backend->name, gr_framebuffer[0].width, gr_framebuffer[0].height,
+            gr_num_buffers);
 
         /* start with 0 as front (displayed) and 1 as back (drawing) */
     gr_active_fb = 0;
-    set_active_framebuffer(0);
+    gr_backend->pan(0);
+
+    get_memory_surface(&gr_mem_surface);
+    gr_add_damage(0, vi.yres);
     gl->colorBuffer(gl, &gr_mem_surface);
 
     gl->activeTexture(gl, 0);
@@ -351,14 +1267,25 @@ int gr_init(void)
 
 void gr_exit(void)
 {
-    close(gr_fb_fd);
-    gr_fb_fd = -1;
+    gr_backend->close();
 
     free(gr_mem_surface.data);
+    gr_mem_surface.data = NULL;
 
-    ioctl(gr_vt_fd, KDSETMODE, (void*) KD_TEXT);
-    close(gr_vt_fd);
-    gr_vt_fd = -1;
+    gr_invalidate_surface(NULL);
+}
+
+void gr_invalidate_surface(gr_surface surface)
+{
+#ifdef RECOVERY_SOFT_RASTER
+    unsigned i;
+
+    for (i = 0; i < GR_ASSET_CACHE; i++) {
+        if (gr_assets[i].pixels != NULL &&
+            (surface == NULL || gr_assets[i].src == surface))
+            gr_asset_free(&gr_assets[i]);
+    }
+#endif
 }
 
 int gr_fb_width(void)
@@ -373,14 +1300,12 @@ int gr_fb_height(void)
 
 gr_pixel *gr_fb_data(void)
 {
+    /* the caller may draw anywhere behind our back */
+    gr_add_damage(0, vi.yres);
     return (unsigned short *) gr_mem_surface.data;
 }
 
 void gr_fb_blank(bool blank)
 {
-    int ret;
-
-    ret = ioctl(gr_fb_fd, FBIOBLANK, blank ? FB_BLANK_POWERDOWN : FB_BLANK_UNBLANK);
-    if (ret < 0)
-        perror("ioctl(): blank");
+    gr_backend->blank(blank);
 }
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * graphics.c with the software raster in gr_soft.h. minui builds the
+ * BOARD_CUSTOM_GRAPHICS file with its own flags, so the switch is made
+ * here; in COMMON_GLOBAL_CFLAGS it would reach every module in the build.
+ */
+#define RECOVERY_SOFT_RASTER
+#include "graphics.c"
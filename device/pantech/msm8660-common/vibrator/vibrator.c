@@ -15,14 +15,40 @@
  */
 #include <hardware_legacy/vibrator.h>
 #include "qemu.h"
+#include "vibrator_pattern.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #define THE_DEVICE "/sys/class/timed_output/vibrator/enable"
 
+/*
+ * The enable node is kept open for the lifetime of the process so that a
+ * haptic tick is a single write(). Patterns are played by a worker thread
+ * sleeping on a timerfd; pattern_event wakes it up when a new pattern is
+ * queued or the current one is cancelled.
+ */
+static pthread_mutex_t vib_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pattern_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pattern_thread;
+static int vib_fd = -1;
+static int pattern_thread_started;
+static int pattern_event_fd = -1;
+static int pattern_timer_fd = -1;
+
+static int pattern[VIBRATOR_PATTERN_MAX];
+static int pattern_count;
+static int pattern_repeat = -1;
+static unsigned pattern_generation;
+
 int vibrator_exists()
 {
     int fd;
@@ -40,21 +66,213 @@ int vibrator_exists()
     return 1;
 }
 
-int sendit(int timeout_ms)
+/* Called with vib_lock held. */
+static int vib_write(int timeout_ms)
 {
-    int nwr, ret, fd;
+    int nwr, ret;
     char value[20];
 
     timeout_ms = 0x140000 | timeout_ms; // add 0x14000 to set vibration level to 31.
-    
-    fd = open(THE_DEVICE, O_RDWR);
-    if(fd < 0)
-        return errno;
-
     nwr = sprintf(value, "%d\n", timeout_ms);
-    ret = write(fd, value, nwr);
 
-    close(fd);
+    if (vib_fd < 0) {
+        vib_fd = open(THE_DEVICE, O_RDWR);
+        if (vib_fd < 0)
+            return errno;
+    }
+
+    ret = write(vib_fd, value, nwr);
+    if (ret < 0 && errno != EINTR) {
+        /* The node went away under us, retry once on a fresh fd. */
+        close(vib_fd);
+        vib_fd = open(THE_DEVICE, O_RDWR);
+        if (vib_fd < 0)
+            return errno;
+        ret = write(vib_fd, value, nwr);
+    }
 
     return (ret == nwr) ? 0 : -1;
 }
+
+static void pattern_wake(void)
+{
+    uint64_t one = 1;
+
+    if (pattern_event_fd >= 0)
+        write(pattern_event_fd, &one, sizeof(one));
+}
+
+/*
+ * Arm the timer for delay_ms and wait for it. Returns non-zero when the
+ * wait was interrupted by a new pattern or a cancel.
+ */
+static int pattern_sleep(int delay_ms)
+{
+    struct itimerspec its;
+    struct pollfd fds[2];
+    uint64_t val;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delay_ms / 1000;
+    its.it_value.tv_nsec = (delay_ms % 1000) * 1000000;
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        return 0;
+    timerfd_settime(pattern_timer_fd, 0, &its, NULL);
+
+    fds[0].fd = pattern_timer_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = pattern_event_fd;
+    fds[1].events = POLLIN;
+
+    while (poll(fds, 2, -1) < 0 && errno == EINTR)
+        ;
+
+    if (fds[1].revents & POLLIN) {
+        read(pattern_event_fd, &val, sizeof(val));
+        memset(&its, 0, sizeof(its));
+        timerfd_settime(pattern_timer_fd, 0, &its, NULL);
+        return 1;
+    }
+
+    read(pattern_timer_fd, &val, sizeof(val));
+    return 0;
+}
+
+static void *pattern_loop(void *arg)
+{
+    unsigned generation;
+    uint64_t val;
+    int i, delay;
+
+    pthread_mutex_lock(&vib_lock);
+
+    for (;;) {
+        while (pattern_count == 0)
+            pthread_cond_wait(&pattern_cond, &vib_lock);
+
+        /* Wakeups meant for an earlier pattern must not cut this one short. */
+        read(pattern_event_fd, &val, sizeof(val));
+        generation = pattern_generation;
+        i = 0;
+
+        while (generation == pattern_generation && i < pattern_count) {
+            delay = pattern[i];
+            /* Even entries are off delays, odd entries are on times. */
+            if ((i & 1) && delay > 0)
+                vib_write(delay);
+
+            pthread_mutex_unlock(&vib_lock);
+            pattern_sleep(delay);
+            pthread_mutex_lock(&vib_lock);
+
+            if (++i == pattern_count && pattern_repeat >= 0)
+                i = pattern_repeat;
+        }
+
+        if (generation == pattern_generation)
+            pattern_count = 0;
+    }
+
+    pthread_mutex_unlock(&vib_lock);
+    return NULL;
+}
+
+/* Called with vib_lock held. */
+static int pattern_thread_start(void)
+{
+    if (pattern_thread_started)
+        return 0;
+
+    pattern_event_fd = eventfd(0, EFD_NONBLOCK);
+    pattern_timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (pattern_event_fd < 0 || pattern_timer_fd < 0)
+        goto fail;
+
+    if (pthread_create(&pattern_thread, NULL, pattern_loop, NULL))
+        goto fail;
+
+    pattern_thread_started = 1;
+    return 0;
+
+fail:
+    if (pattern_event_fd >= 0)
+        close(pattern_event_fd);
+    if (pattern_timer_fd >= 0)
+        close(pattern_timer_fd);
+    pattern_event_fd = pattern_timer_fd = -1;
+    return -1;
+}
+
+/* Called with vib_lock held. */
+static void pattern_stop(void)
+{
+    if (pattern_count == 0)
+        return;
+
+    pattern_count = 0;
+    pattern_generation++;
+    pattern_wake();
+}
+
+int vibrator_play_pattern(const int *timings, int count, int repeat)
+{
+    long long loop_ms = 0;
+    int ret = 0;
+    int i;
+
+    if (timings == NULL || count <= 0 || count > VIBRATOR_PATTERN_MAX ||
+            repeat >= count)
+        return -EINVAL;
+
+    for (i = 0; i < count; i++) {
+        if (timings[i] < 0)
+            return -EINVAL;
+        if (repeat >= 0 && i >= repeat)
+            loop_ms += timings[i];
+    }
+
+    /* A repeating segment that takes no time would spin forever. */
+    if (repeat >= 0 && loop_ms == 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&vib_lock);
+
+    if (pattern_thread_start() < 0) {
+        ret = -1;
+    } else {
+        pattern_stop();
+        memcpy(pattern, timings, count * sizeof(*timings));
+        pattern_count = count;
+        pattern_repeat = repeat;
+        pattern_generation++;
+        pthread_cond_signal(&pattern_cond);
+    }
+
+    pthread_mutex_unlock(&vib_lock);
+    return ret;
+}
+
+int vibrator_cancel_pattern(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&vib_lock);
+    pattern_stop();
+    ret = vib_write(0);
+    pthread_mutex_unlock(&vib_lock);
+
+    return ret;
+}
+
+int sendit(int timeout_ms)
+{
+    int ret;
+
+    pthread_mutex_lock(&vib_lock);
+    /* A direct on/off request supersedes any pattern being played. */
+    pattern_stop();
+    ret = vib_write(timeout_ms);
+    pthread_mutex_unlock(&vib_lock);
+
+    return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _VIBRATOR_PATTERN_H
+#define _VIBRATOR_PATTERN_H
+
+#if __cplusplus
+extern "C" {
+#endif
+
+#define VIBRATOR_PATTERN_MAX 64
+
+/**
+ * Play an on/off pattern asynchronously.
+ *
+ * timings alternates off and on durations in milliseconds, starting with
+ * the delay before the first vibration (the same layout as
+ * android.os.Vibrator.vibrate(long[], int)). If repeat is >= 0 the
+ * pattern loops back to that index until cancelled.
+ *
+ * @return 0 on success, -EINVAL for a negative timing or a repeating
+ *         segment that adds up to 0 ms, negative on other errors
+ */
+int vibrator_play_pattern(const int *timings, int count, int repeat);
+
+/**
+ * Stop the pattern being played, if any, and turn the vibrator off.
+ *
+ * @return 0 on success, -1 on error
+ */
+int vibrator_cancel_pattern(void);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _VIBRATOR_PATTERN_H
@@ -21,9 +21,19 @@
 #include <dirent.h>
 #include <sys/socket.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/netlink.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "hardware_legacy/wifi.h"
 #include "libwpa_client/wpa_ctrl.h"
+#include "wifi_batch.h"
+#include "wifi_event.h"
+#include "wifi_bringup.h"
 //#include "hardware_legacy/wpa_ctrl.h"
 
 #define LOG_TAG "WifiHW"
@@ -35,21 +45,37 @@
 #ifdef HAVE_LIBC_SYSTEM_PROPERTIES
 #define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
 #include <sys/_system_properties.h>
+#include <sys/atomics.h>
 #endif
 
 static struct wpa_ctrl *ctrl_conn;
 static struct wpa_ctrl *monitor_conn;
 /* socket pair used to exit from a blocking read */
 static int exit_sockets[2] = { -1, -1 };
+/* serializes requests on ctrl_conn, and guards cmd_stats and ctrl_stale */
+static pthread_mutex_t ctrl_lock = PTHREAD_MUTEX_INITIALIZER;
+/* replies still owed to requests that timed out, due before any later one */
+static int ctrl_stale;
 
 extern int do_dhcp();
 extern int ifc_init();
 extern void ifc_close();
+extern int ifc_up(const char *name);
+extern int ifc_down(const char *name);
+extern int ifc_is_up(const char *name, unsigned *isup);
 extern char *dhcp_lasterror();
 extern void get_dhcp_info();
 extern int init_module(void *, unsigned long, const char *);
 extern int delete_module(const char *, unsigned int);
 
+#ifndef __NR_finit_module
+#if defined(__arm__)
+#define __NR_finit_module 379
+#elif defined(__i386__)
+#define __NR_finit_module 350
+#endif
+#endif
+
 static char iface[PROPERTY_VALUE_MAX];
 // TODO: use new ANDROID_SOCKET mechanism, once support for multiple
 // sockets is in
@@ -90,6 +116,11 @@ static const char EXT_MODULE_ARG[] = "";
 static const char EXT_MODULE_PATH[] = WIFI_EXT_MODULE_PATH;
 #endif
 
+/* Only a module can be kept loaded. */
+#ifndef WIFI_DRIVER_MODULE_PATH
+#undef WIFI_DRIVER_KEEP_LOADED
+#endif
+
 #ifndef WIFI_DRIVER_FW_PATH_PARAM
 #define WIFI_DRIVER_FW_PATH_PARAM	"/sys/module/wlan/parameters/fwpath"
 #endif
@@ -98,13 +129,11 @@ static const char EXT_MODULE_PATH[] = WIFI_EXT_MODULE_PATH;
 static const char IFACE_DIR[]           = "/data/misc/wpa_supplicant";
 #ifdef WIFI_DRIVER_MODULE_PATH
 static const char DRIVER_MODULE_NAME[]  = WIFI_DRIVER_MODULE_NAME;
-static const char DRIVER_MODULE_TAG[]   = WIFI_DRIVER_MODULE_NAME " ";
 static const char DRIVER_MODULE_PATH[]  = WIFI_DRIVER_MODULE_PATH;
 static const char DRIVER_MODULE_ARG[]   = WIFI_DRIVER_MODULE_ARG;
 #endif
 #ifdef WIFI_AP_DRIVER_MODULE_PATH
 static const char AP_DRIVER_MODULE_NAME[] = WIFI_AP_DRIVER_MODULE_NAME;
-static const char AP_DRIVER_MODULE_TAG[]  = WIFI_AP_DRIVER_MODULE_NAME " ";
 static const char AP_DRIVER_MODULE_PATH[] = WIFI_AP_DRIVER_MODULE_PATH;
 static const char AP_DRIVER_MODULE_ARG[]  = WIFI_AP_DRIVER_MODULE_ARG;
 #endif
@@ -120,7 +149,30 @@ static const char SUPP_CONFIG_TEMPLATE[]      = "/system/etc/wifi/wpa_supplicant
 static const char SUPP_CONFIG_FILE[]          = "/data/misc/wifi/wpa_supplicant.conf";
 static const char P2P_CONFIG_FILE[]           = "/data/misc/wifi/p2p_supplicant.conf";
 static const char CONTROL_IFACE_PATH[]        = "/data/misc/wifi";
-static const char MODULE_FILE[]               = "/proc/modules";
+static const char SYSFS_MODULE_DIR[]          = "/sys/module";
+static const char SYSFS_NET_DIR[]             = "/sys/class/net";
+
+/*
+ * Driver load and unload completion is taken from kernel uevents; the
+ * poll interval only matters if the uevent socket can't be opened or an
+ * event is missed, in which case the state is checked directly.
+ */
+#define WIFI_POLL_MS            200
+#define WIFI_LOAD_TIMEOUT_MS    20000
+#define WIFI_IFACE_TIMEOUT_MS   2000
+#define WIFI_UNLOAD_TIMEOUT_MS  10000
+#define WIFI_CARD_REMOVE_MS     500
+#define UEVENT_MSG_LEN          2048
+
+#define SUPP_START_TIMEOUT_MS   20000
+#define SUPP_STOP_TIMEOUT_MS    5000
+
+struct uevent {
+    const char *action;
+    const char *devpath;
+    const char *subsystem;
+    const char *interface;
+};
 
 static const char SUPP_ENTROPY_FILE[]   = WIFI_ENTROPY_FILE;
 static unsigned char dummy_key[21] = { 0x02, 0x11, 0xbe, 0x33, 0x43, 0x35,
@@ -156,20 +208,68 @@ char* get_samsung_wifi_type()
 }
 #endif
 
-static int insmod(const char *filename, const char *args)
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Hand the module to the kernel without copying it into a heap buffer
+ * first: by fd with finit_module where the kernel has it, else from a
+ * read-only mapping of the file.
+ */
+static int insmod_fd(int fd, const char *args)
 {
+    struct stat sb;
     void *module;
-    unsigned int size;
     int ret;
 
-    module = load_file(filename, &size);
-    if (!module)
+#ifdef __NR_finit_module
+    ret = syscall(__NR_finit_module, fd, args, 0);
+    if (ret == 0 || errno != ENOSYS)
+        return ret;
+#endif
+
+    if (fstat(fd, &sb) < 0)
+        return -1;
+    module = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (module == MAP_FAILED)
         return -1;
+    ret = init_module(module, sb.st_size, args);
+    munmap(module, sb.st_size);
+    return ret;
+}
+
+static long max_rss_kb(void)
+{
+    struct rusage ru;
 
-    ret = init_module(module, size, args);
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return 0;
+    return ru.ru_maxrss;
+}
+
+static int insmod(const char *filename, const char *args)
+{
+    long long start = now_ms();
+    long rss = max_rss_kb();
+    int fd, ret, err;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
 
-    free(module);
+    ret = insmod_fd(fd, args);
+    err = errno;
+    close(fd);
 
+    if (ret == 0)
+        LOGD("Loaded \"%s\" in %lld ms, peak RSS %ld -> %ld KB",
+             filename, now_ms() - start, rss, max_rss_kb());
+    errno = err;
     return ret;
 }
 
@@ -179,7 +279,7 @@ static int rmmod(const char *modname)
     int maxtry = 10;
 
     while (maxtry-- > 0) {
-        ret = delete_module("wlan", O_NONBLOCK | O_EXCL);
+        ret = delete_module(modname, O_NONBLOCK | O_EXCL);
         if (ret < 0 && errno == EAGAIN)
             usleep(500000);
         else
@@ -192,6 +292,254 @@ static int rmmod(const char *modname)
     return ret;
 }
 
+/* Open before triggering the change, so that no event can be missed. */
+static int uevent_open(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = 0;
+    addr.nl_groups = 0xffffffff;
+
+    fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        LOGW("Cannot open uevent socket, polling instead: %s", strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        LOGW("Cannot bind uevent socket, polling instead: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void uevent_parse(const char *msg, int len, struct uevent *ev)
+{
+    const char *end = msg + len;
+
+    ev->action = "";
+    ev->devpath = "";
+    ev->subsystem = "";
+    ev->interface = "";
+
+    while (msg < end && *msg) {
+        if (!strncmp(msg, "ACTION=", 7))
+            ev->action = msg + 7;
+        else if (!strncmp(msg, "DEVPATH=", 8))
+            ev->devpath = msg + 8;
+        else if (!strncmp(msg, "SUBSYSTEM=", 10))
+            ev->subsystem = msg + 10;
+        else if (!strncmp(msg, "INTERFACE=", 10))
+            ev->interface = msg + 10;
+        msg += strlen(msg) + 1;
+    }
+}
+
+/*
+ * Wait until match() accepts a uevent or check() reports the state was
+ * reached, whichever comes first; check() is tried every WIFI_POLL_MS.
+ * Either may be NULL. Returns 0 on success, -1 on timeout.
+ */
+static int uevent_wait(int fd, int (*match)(const struct uevent *),
+                       int (*check)(void), int timeout_ms)
+{
+    char msg[UEVENT_MSG_LEN + 2];
+    long long deadline = now_ms() + timeout_ms;
+    struct pollfd pfd;
+    struct uevent ev;
+    int n, wait;
+
+    for (;;) {
+        if (check != NULL && check())
+            return 0;
+
+        wait = deadline - now_ms();
+        if (wait <= 0)
+            return -1;
+        if (check != NULL && wait > WIFI_POLL_MS)
+            wait = WIFI_POLL_MS;
+
+        if (fd < 0 || match == NULL) {
+            usleep(wait * 1000);
+            continue;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, wait) <= 0 || !(pfd.revents & POLLIN))
+            continue;
+
+        while ((n = recv(fd, msg, UEVENT_MSG_LEN, MSG_DONTWAIT)) > 0) {
+            msg[n] = msg[n + 1] = '\0';
+            uevent_parse(msg, n, &ev);
+            if (match(&ev))
+                return 0;
+        }
+    }
+}
+
+static const char *wifi_iface_name(char *buf)
+{
+    property_get("wifi.interface", buf, "wlan0");
+    return buf;
+}
+
+static int match_iface_added(const struct uevent *ev)
+{
+    char name[PROPERTY_VALUE_MAX];
+
+    return !strcmp(ev->action, "add") && !strcmp(ev->subsystem, "net") &&
+           !strcmp(ev->interface, wifi_iface_name(name));
+}
+
+static int check_iface_present(void)
+{
+    char name[PROPERTY_VALUE_MAX];
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", SYSFS_NET_DIR, wifi_iface_name(name));
+    return access(path, F_OK) == 0;
+}
+
+/*
+ * A module's /sys/module/<name>/initstate reads "live" once its init has
+ * run. That is one small read, where /proc/modules has the kernel format
+ * the whole module list.
+ */
+static int module_live(const char *name)
+{
+    char path[PATH_MAX];
+    char state[16];
+    int fd, n;
+
+    snprintf(path, sizeof(path), "%s/%s/initstate", SYSFS_MODULE_DIR, name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    n = read(fd, state, sizeof(state) - 1);
+    close(fd);
+    return n >= 4 && strncmp(state, "live", 4) == 0;
+}
+
+/* Set when the SDIO card's removal is seen while waiting for the module. */
+static int card_removed;
+
+static int match_card_removed(const struct uevent *ev)
+{
+    return !strcmp(ev->action, "remove") && !strcmp(ev->subsystem, "mmc");
+}
+
+#ifdef WIFI_DRIVER_MODULE_PATH
+static int match_driver_removed(const struct uevent *ev)
+{
+    card_removed |= match_card_removed(ev);
+    return !strcmp(ev->action, "remove") &&
+           !strcmp(ev->devpath, "/module/" WIFI_DRIVER_MODULE_NAME);
+}
+
+static int check_driver_gone(void)
+{
+    return !module_live(DRIVER_MODULE_NAME);
+}
+#endif
+
+#ifdef WIFI_AP_DRIVER_MODULE_PATH
+static int match_ap_driver_removed(const struct uevent *ev)
+{
+    card_removed |= match_card_removed(ev);
+    return !strcmp(ev->action, "remove") &&
+           !strcmp(ev->devpath, "/module/" WIFI_AP_DRIVER_MODULE_NAME);
+}
+
+static int check_ap_driver_gone(void)
+{
+    return !module_live(AP_DRIVER_MODULE_NAME);
+}
+#endif
+
+
+/*
+ * Once the module is in, its interface shows up when the SDIO probe
+ * completes. Bringing up the supplicant before then only fails, so hold
+ * the "ok" status back until it appears (or a short timeout passes).
+ */
+static void wait_for_iface(int fd)
+{
+    if (uevent_wait(fd, match_iface_added, check_iface_present,
+                    WIFI_IFACE_TIMEOUT_MS) < 0)
+        LOGW("Wi-Fi interface did not appear after driver load");
+}
+
+static int write_fw_path(const char *fwpath)
+{
+    int len;
+    int fd;
+    int ret = 0;
+
+    if (!fwpath)
+        return ret;
+
+    fd = open(WIFI_DRIVER_FW_PATH_PARAM, O_WRONLY);
+    if (fd < 0) {
+        LOGE("Failed to open wlan fw path param (%s)", strerror(errno));
+        return -1;
+    }
+    len = strlen(fwpath) + 1;
+    if (write(fd, fwpath, len) != len) {
+        LOGE("Failed to write wlan fw path param (%s)", strerror(errno));
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+#ifdef WIFI_DRIVER_KEEP_LOADED
+/*
+ * With WIFI_DRIVER_KEEP_LOADED the module stays in once it has been
+ * loaded. Unloading only takes the interface down, and the next bring-up
+ * relies on the driver downloading whatever firmware_path names when the
+ * interface comes up. Switching between station, hotspot and P2P firmware
+ * then costs one interface cycle instead of an rmmod/insmod. Only set it
+ * for a driver known to power the chip off on ifdown and to reload the
+ * firmware on ifup; that hasn't been checked for the bcm4329 wlan.ko.
+ */
+static int driver_resident(void)
+{
+    return module_live(DRIVER_MODULE_NAME) && check_iface_present();
+}
+
+static int set_iface_up(int up)
+{
+    char name[PROPERTY_VALUE_MAX];
+    int ret;
+
+    if (ifc_init() < 0)
+        return -1;
+    wifi_iface_name(name);
+    ret = up ? ifc_up(name) : ifc_down(name);
+    ifc_close();
+    return ret;
+}
+
+static int iface_is_up(void)
+{
+    char name[PROPERTY_VALUE_MAX];
+    unsigned up = 0;
+
+    if (ifc_init() < 0)
+        return 0;
+    if (ifc_is_up(wifi_iface_name(name), &up) < 0)
+        up = 0;
+    ifc_close();
+    return up;
+}
+#endif
+
 int do_dhcp_request(int *ipaddr, int *gateway, int *mask,
                     int *dns1, int *dns2, int *server, int *lease) {
     /* For test driver, always report success */
@@ -214,15 +562,48 @@ const char *get_dhcp_error_string() {
     return dhcp_lasterror();
 }
 
-int is_wifi_driver_loaded() {
+/*
+ * What is_wifi_driver_loaded last found for the status property, read
+ * again only when the property's serial changes. The module state is
+ * read from sysfs every time; that is one small read.
+ */
+#ifdef HAVE_LIBC_SYSTEM_PROPERTIES
+static pthread_mutex_t driver_status_lock = PTHREAD_MUTEX_INITIALIZER;
+static const prop_info *driver_pi;
+static unsigned driver_serial;
+static int driver_status_ok = -1;
+#endif
+
+static int driver_status_is_ok(void)
+{
     char driver_status[PROPERTY_VALUE_MAX];
-#ifdef WIFI_DRIVER_MODULE_PATH
-    FILE *proc;
-    char line[sizeof(DRIVER_MODULE_TAG)+10];
+
+#ifdef HAVE_LIBC_SYSTEM_PROPERTIES
+    int ok = -1;
+
+    pthread_mutex_lock(&driver_status_lock);
+    if (driver_pi == NULL)
+        driver_pi = __system_property_find(DRIVER_PROP_NAME);
+    if (driver_pi != NULL) {
+        unsigned serial = driver_pi->serial;
+
+        if (driver_status_ok < 0 || serial != driver_serial) {
+            __system_property_read(driver_pi, NULL, driver_status);
+            driver_status_ok = strcmp(driver_status, "ok") == 0;
+            driver_serial = serial;
+        }
+        ok = driver_status_ok;
+    }
+    pthread_mutex_unlock(&driver_status_lock);
+    if (ok >= 0)
+        return ok;
 #endif
+    return property_get(DRIVER_PROP_NAME, driver_status, NULL)
+            && strcmp(driver_status, "ok") == 0;
+}
 
-    if (!property_get(DRIVER_PROP_NAME, driver_status, NULL)
-            || strcmp(driver_status, "ok") != 0) {
+int is_wifi_driver_loaded() {
+    if (!driver_status_is_ok()) {
         return 0;  /* driver not loaded */
     }
 #ifdef WIFI_DRIVER_MODULE_PATH
@@ -232,42 +613,53 @@ int is_wifi_driver_loaded() {
      * over from a previous manual shutdown or a runtime
      * crash.
      */
-    if ((proc = fopen(MODULE_FILE, "r")) == NULL) {
-        LOGW("Could not open %s: %s", MODULE_FILE, strerror(errno));
+    if (!module_live(DRIVER_MODULE_NAME)) {
         property_set(DRIVER_PROP_NAME, "unloaded");
         return 0;
     }
-    while ((fgets(line, sizeof(line), proc)) != NULL) {
-        if (strncmp(line, DRIVER_MODULE_TAG, strlen(DRIVER_MODULE_TAG)) == 0) {
-            fclose(proc);
-            return 1;
-        }
-    }
-    fclose(proc);
-    property_set(DRIVER_PROP_NAME, "unloaded");
-    return 0;
-#else
-    return 1;
 #endif
+    return 1;
 }
 
+static int load_driver_for(const char *config_file);
+static void prep_discard(void);
+
 int wifi_load_driver()
+{
+    return load_driver_for(SUPP_CONFIG_FILE);
+}
+
+static int load_driver(void)
 {
 #ifdef WIFI_DRIVER_MODULE_PATH
     char driver_status[PROPERTY_VALUE_MAX];
-    int count = 100; /* wait at most 20 seconds for completion */
+    int count = WIFI_LOAD_TIMEOUT_MS / WIFI_POLL_MS;
     char module_arg[PROPERTY_VALUE_MAX];
     char module_arg2[256];
+    long long start = now_ms();
+    int uevent_fd;
 
-    if (is_wifi_driver_loaded()) {
+#ifdef WIFI_DRIVER_KEEP_LOADED
+    if (driver_resident()) {
+        /* the last user may have left another firmware selected */
+        if (write_fw_path(WIFI_DRIVER_FW_PATH_STA) < 0)
+            return -1;
+        property_set(DRIVER_PROP_NAME, "ok");
+        LOGI("Wi-Fi driver already resident, ready in %lld ms", now_ms() - start);
         return 0;
     }
+#endif
 
     property_set(DRIVER_PROP_NAME, "loading");
+    uevent_fd = uevent_open();
 
 #ifdef WIFI_EXT_MODULE_PATH
-    if (insmod(EXT_MODULE_PATH, EXT_MODULE_ARG) < 0)
+    if (insmod(EXT_MODULE_PATH, EXT_MODULE_ARG) < 0) {
+        if (uevent_fd >= 0)
+            close(uevent_fd);
+        property_set(DRIVER_PROP_NAME, "failed");
         return -1;
+    }
     usleep(200000);
 #endif
 
@@ -284,6 +676,9 @@ int wifi_load_driver()
 #ifdef WIFI_EXT_MODULE_NAME
         rmmod(EXT_MODULE_NAME);
 #endif
+        if (uevent_fd >= 0)
+            close(uevent_fd);
+        property_set(DRIVER_PROP_NAME, "failed");
         return -1;
     }
 
@@ -291,22 +686,26 @@ int wifi_load_driver()
 #ifdef WIFI_DRIVER_LOADER_DELAY
         usleep(WIFI_DRIVER_LOADER_DELAY);
 #endif
+        wait_for_iface(uevent_fd);
         property_set(DRIVER_PROP_NAME, "ok");
     }
     else {
         property_set("ctl.start", FIRMWARE_LOADER);
     }
+    if (uevent_fd >= 0)
+        close(uevent_fd);
     sched_yield();
     while (count-- > 0) {
         if (property_get(DRIVER_PROP_NAME, driver_status, NULL)) {
-            if (strcmp(driver_status, "ok") == 0)
+            if (strcmp(driver_status, "ok") == 0) {
+                LOGI("Wi-Fi driver loaded in %lld ms", now_ms() - start);
                 return 0;
-            else if (strcmp(DRIVER_PROP_NAME, "failed") == 0) {
+            } else if (strcmp(driver_status, "failed") == 0) {
                 wifi_unload_driver();
                 return -1;
             }
         }
-        usleep(200000);
+        usleep(WIFI_POLL_MS * 1000);
     }
     property_set(DRIVER_PROP_NAME, "timeout");
     wifi_unload_driver();
@@ -319,25 +718,46 @@ int wifi_load_driver()
 
 int wifi_unload_driver()
 {
-    usleep(200000); /* allow to finish interface down */
 #ifdef WIFI_DRIVER_MODULE_PATH
-    if (rmmod(DRIVER_MODULE_NAME) == 0) {
-        int count = 20; /* wait at most 10 seconds for completion */
-        while (count-- > 0) {
-            if (!is_wifi_driver_loaded())
-                break;
-            usleep(500000);
-        }
-        usleep(500000); /* allow card removal */
-        if (count) {
+    long long start = now_ms();
+    int uevent_fd;
+    int ret = -1;
+#endif
+
+    prep_discard();
+
+#ifdef WIFI_DRIVER_MODULE_PATH
+#ifdef WIFI_DRIVER_KEEP_LOADED
+    if (driver_resident()) {
+        ret = set_iface_up(0);
+        property_set(DRIVER_PROP_NAME, "unloaded");
+        LOGI("Wi-Fi driver left resident, down in %lld ms", now_ms() - start);
+        return ret;
+    }
+#endif
+
+    uevent_fd = uevent_open();
+
+    /* rmmod retries for as long as the interface is still going down */
+    card_removed = 0;
+    if (rmmod(DRIVER_MODULE_NAME) == 0 &&
+        uevent_wait(uevent_fd, match_driver_removed, check_driver_gone,
+                    WIFI_UNLOAD_TIMEOUT_MS) == 0) {
+        property_set(DRIVER_PROP_NAME, "unloaded");
+        /* the card goes away once the module has powered it down */
+        if (!card_removed)
+            uevent_wait(uevent_fd, match_card_removed, NULL, WIFI_CARD_REMOVE_MS);
 #ifdef WIFI_EXT_MODULE_NAME
-            if (rmmod(EXT_MODULE_NAME) == 0)
+        if (rmmod(EXT_MODULE_NAME) == 0)
 #endif
-            return 0;
-        }
-        return -1;
-    } else
-        return -1;
+        ret = 0;
+    }
+
+    if (uevent_fd >= 0)
+        close(uevent_fd);
+    if (ret == 0)
+        LOGI("Wi-Fi driver unloaded in %lld ms", now_ms() - start);
+    return ret;
 #else
     property_set(DRIVER_PROP_NAME, "unloaded");
     return 0;
@@ -349,8 +769,6 @@ int is_wifi_hotspot_driver_loaded() {
     return is_wifi_driver_loaded();
 #else
     char driver_status[PROPERTY_VALUE_MAX];
-    FILE *proc;
-    char line[sizeof(AP_DRIVER_MODULE_TAG)+10];
 
     if (!property_get(AP_DRIVER_PROP_NAME, driver_status, NULL)
             || strcmp(driver_status, "ok") != 0) {
@@ -362,20 +780,11 @@ int is_wifi_hotspot_driver_loaded() {
      * over from a previous manual shutdown or a runtime
      * crash.
      */
-    if ((proc = fopen(MODULE_FILE, "r")) == NULL) {
-        LOGW("Could not open %s: %s", MODULE_FILE, strerror(errno));
+    if (!module_live(AP_DRIVER_MODULE_NAME)) {
         property_set(AP_DRIVER_PROP_NAME, "unloaded");
         return 0;
     }
-    while ((fgets(line, sizeof(line), proc)) != NULL) {
-        if (strncmp(line, AP_DRIVER_MODULE_TAG, strlen(AP_DRIVER_MODULE_TAG)) == 0) {
-            fclose(proc);
-            return 1;
-        }
-    }
-    fclose(proc);
-    property_set(AP_DRIVER_PROP_NAME, "unloaded");
-    return 0;
+    return 1;
 #endif
 }
 
@@ -385,18 +794,25 @@ int wifi_load_hotspot_driver()
     return wifi_load_driver();
 #else
     char driver_status[PROPERTY_VALUE_MAX];
-    int count = 100; /* wait at most 20 seconds for completion */
+    int count = WIFI_LOAD_TIMEOUT_MS / WIFI_POLL_MS;
     char module_arg[PROPERTY_VALUE_MAX];
+    long long start = now_ms();
+    int uevent_fd;
 
     if (is_wifi_hotspot_driver_loaded()) {
         return 0;
     }
 
     property_set(AP_DRIVER_PROP_NAME, "loading");
+    uevent_fd = uevent_open();
 
 #ifdef WIFI_EXT_MODULE_PATH
-    if (insmod(EXT_MODULE_PATH, EXT_MODULE_ARG) < 0)
+    if (insmod(EXT_MODULE_PATH, EXT_MODULE_ARG) < 0) {
+        if (uevent_fd >= 0)
+            close(uevent_fd);
+        property_set(AP_DRIVER_PROP_NAME, "failed");
         return -1;
+    }
     usleep(200000);
 #endif
 
@@ -405,6 +821,9 @@ int wifi_load_hotspot_driver()
 #ifdef WIFI_EXT_MODULE_NAME
         rmmod(EXT_MODULE_NAME);
 #endif
+        if (uevent_fd >= 0)
+            close(uevent_fd);
+        property_set(AP_DRIVER_PROP_NAME, "failed");
         return -1;
     }
 
@@ -412,22 +831,26 @@ int wifi_load_hotspot_driver()
 #ifdef WIFI_DRIVER_LOADER_DELAY
         usleep(WIFI_DRIVER_LOADER_DELAY);
 #endif
+        wait_for_iface(uevent_fd);
         property_set(AP_DRIVER_PROP_NAME, "ok");
     }
     else {
         property_set("ctl.start", AP_FIRMWARE_LOADER);
     }
+    if (uevent_fd >= 0)
+        close(uevent_fd);
     sched_yield();
     while (count-- > 0) {
         if (property_get(AP_DRIVER_PROP_NAME, driver_status, NULL)) {
-            if (strcmp(driver_status, "ok") == 0)
+            if (strcmp(driver_status, "ok") == 0) {
+                LOGI("Wi-Fi hotspot driver loaded in %lld ms", now_ms() - start);
                 return 0;
-            else if (strcmp(AP_DRIVER_PROP_NAME, "failed") == 0) {
+            } else if (strcmp(driver_status, "failed") == 0) {
                 wifi_unload_hotspot_driver();
                 return -1;
             }
         }
-        usleep(200000);
+        usleep(WIFI_POLL_MS * 1000);
     }
     property_set(AP_DRIVER_PROP_NAME, "timeout");
     wifi_unload_hotspot_driver();
@@ -440,24 +863,28 @@ int wifi_unload_hotspot_driver()
 #ifndef WIFI_AP_DRIVER_MODULE_PATH
     return wifi_unload_driver();
 #else
-    usleep(200000); /* allow to finish interface down */
-    if (rmmod(AP_DRIVER_MODULE_NAME) == 0) {
-        int count = 20; /* wait at most 10 seconds for completion */
-        while (count-- > 0) {
-            if (!is_wifi_hotspot_driver_loaded())
-                break;
-            usleep(500000);
-        }
-        usleep(500000); /* allow card removal */
-        if (count) {
+    long long start = now_ms();
+    int uevent_fd = uevent_open();
+    int ret = -1;
+
+    card_removed = 0;
+    if (rmmod(AP_DRIVER_MODULE_NAME) == 0 &&
+        uevent_wait(uevent_fd, match_ap_driver_removed, check_ap_driver_gone,
+                    WIFI_UNLOAD_TIMEOUT_MS) == 0) {
+        property_set(AP_DRIVER_PROP_NAME, "unloaded");
+        if (!card_removed)
+            uevent_wait(uevent_fd, match_card_removed, NULL, WIFI_CARD_REMOVE_MS);
 #ifdef WIFI_EXT_MODULE_NAME
-            if (rmmod(EXT_MODULE_NAME) == 0)
+        if (rmmod(EXT_MODULE_NAME) == 0)
 #endif
-            return 0;
-        }
-        return -1;
-    } else
-        return -1;
+        ret = 0;
+    }
+
+    if (uevent_fd >= 0)
+        close(uevent_fd);
+    if (ret == 0)
+        LOGI("Wi-Fi hotspot driver unloaded in %lld ms", now_ms() - start);
+    return ret;
 #endif
 }
 
@@ -505,64 +932,227 @@ int ensure_entropy_file_exists()
     return 0;
 }
 
-int update_ctrl_interface(const char *config_file) {
-
-    int srcfd, destfd;
-    int nread;
+/*
+ * The result of the last successful check of each config file, keyed by
+ * the file's identity, so an unchanged file isn't read again on every
+ * supplicant start.
+ */
+struct conf_state {
+    char path[PATH_MAX];
     char ifc[PROPERTY_VALUE_MAX];
-    char *pbuf;
-    char *sptr;
-    struct stat sb;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
 
-    if (stat(config_file, &sb) != 0)
-        return -1;
+static struct conf_state conf_cache[2];
 
-    pbuf = malloc(sb.st_size + PROPERTY_VALUE_MAX);
-    if (!pbuf)
-        return 0;
-    srcfd = open(config_file, O_RDONLY);
-    if (srcfd < 0) {
-        LOGE("Cannot open \"%s\": %s", config_file, strerror(errno));
-        free(pbuf);
-        return 0;
-    }
-    nread = read(srcfd, pbuf, sb.st_size);
-    close(srcfd);
-    if (nread < 0) {
-        LOGE("Cannot read \"%s\": %s", config_file, strerror(errno));
-        free(pbuf);
-        return 0;
-    }
+static struct conf_state *conf_cache_slot(const char *config_file)
+{
+    return &conf_cache[strcmp(config_file, SUPP_CONFIG_FILE) != 0];
+}
 
-    if (!strcmp(config_file, SUPP_CONFIG_FILE)) {
-        property_get("wifi.interface", ifc, WIFI_TEST_INTERFACE);
-    } else {
-        strcpy(ifc, CONTROL_IFACE_PATH);
-    }
-    if ((sptr = strstr(pbuf, "ctrl_interface="))) {
-        char *iptr = sptr + strlen("ctrl_interface=");
-        int ilen = 0;
-        int mlen = strlen(ifc);
-        int nwrite;
-        if (strncmp(ifc, iptr, mlen) != 0) {
-            LOGE("ctrl_interface != %s", ifc);
-            while (((ilen + (iptr - pbuf)) < nread) && (iptr[ilen] != '\n'))
-                ilen++;
-            mlen = ((ilen >= mlen) ? ilen : mlen) + 1;
-            memmove(iptr + mlen, iptr + ilen + 1, nread - (iptr + ilen + 1 - pbuf));
-            memset(iptr, '\n', mlen);
-            memcpy(iptr, ifc, strlen(ifc));
-            destfd = open(config_file, O_RDWR, 0660);
-            if (destfd < 0) {
-                LOGE("Cannot update \"%s\": %s", config_file, strerror(errno));
-                free(pbuf);
-                return -1;
-            }
-            write(destfd, pbuf, nread + mlen - ilen -1);
-            close(destfd);
+static int conf_cache_valid(const char *config_file, const char *ifc,
+                            const struct stat *sb)
+{
+    const struct conf_state *c = conf_cache_slot(config_file);
+
+    return !strcmp(c->path, config_file) && !strcmp(c->ifc, ifc) &&
+           c->dev == sb->st_dev && c->ino == sb->st_ino &&
+           c->size == sb->st_size && c->mtime == sb->st_mtime;
+}
+
+static void conf_cache_store(const char *config_file, const char *ifc)
+{
+    struct conf_state *c = conf_cache_slot(config_file);
+    struct stat sb;
+
+    if (stat(config_file, &sb) != 0) {
+        c->path[0] = '\0';
+        return;
+    }
+    strlcpy(c->path, config_file, sizeof(c->path));
+    strlcpy(c->ifc, ifc, sizeof(c->ifc));
+    c->dev = sb.st_dev;
+    c->ino = sb.st_ino;
+    c->size = sb.st_size;
+    c->mtime = sb.st_mtime;
+}
+
+/*
+ * Find the ctrl_interface= line. On return *line and *len give its offset
+ * and length including the newline, and value holds (the start of) its
+ * value. Returns 1 if found, 0 if not, -1 on a read error.
+ */
+static int find_ctrl_interface(int fd, off_t *line, size_t *len,
+                               char *value, size_t value_len)
+{
+    static const char key[] = "ctrl_interface=";
+    char buf[1024];
+    off_t pos = 0;
+    int at_start = 1, found = 0, i, n;
+    size_t vlen = 0;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++, pos++) {
+            char c = buf[i];
+
+            if (found) {
+                if (c == '\n') {
+                    *len = pos + 1 - *line;
+                    value[vlen] = '\0';
+                    return 1;
+                }
+                if (vlen + 1 < value_len)
+                    value[vlen++] = c;
+                continue;
+            }
+
+            /* match the key at the start of a line, across reads */
+            if (at_start > 0 && c == key[at_start - 1]) {
+                if (key[at_start] == '\0') {
+                    found = 1;
+                    *line = pos + 1 - (sizeof(key) - 1);
+                    vlen = 0;
+                } else {
+                    at_start++;
+                }
+            } else {
+                at_start = c == '\n' ? 1 : 0;
+            }
         }
     }
-    free(pbuf);
+    if (n < 0)
+        return -1;
+    if (found) {
+        /* last line without a newline */
+        *len = pos - *line;
+        value[vlen] = '\0';
+    }
+    return found;
+}
+
+static int copy_range(int srcfd, int destfd, off_t from, off_t to)
+{
+    char buf[4096];
+    int n;
+
+    if (lseek(srcfd, from, SEEK_SET) < 0)
+        return -1;
+    while (to < 0 || from < to) {
+        size_t want = sizeof(buf);
+        if (to >= 0 && (off_t) want > to - from)
+            want = to - from;
+        n = read(srcfd, buf, want);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        if (write(destfd, buf, n) != n)
+            return -1;
+        from += n;
+    }
+    return 0;
+}
+
+/*
+ * Rewrite the ctrl_interface= line. If the new line has the same length it
+ * is written in place, otherwise the file is streamed to a temporary copy
+ * with the line replaced, which is then renamed over the original.
+ */
+static int replace_ctrl_interface(const char *config_file, int srcfd,
+                                  off_t line, size_t len, const char *ifc)
+{
+    char entry[PROPERTY_VALUE_MAX + 32];
+    char tmp[PATH_MAX];
+    int n, destfd;
+
+    n = snprintf(entry, sizeof(entry), "ctrl_interface=%s\n", ifc);
+
+    if ((size_t) n == len) {
+        destfd = open(config_file, O_WRONLY);
+        if (destfd < 0 || pwrite(destfd, entry, n, line) != n) {
+            LOGE("Cannot update \"%s\": %s", config_file, strerror(errno));
+            if (destfd >= 0)
+                close(destfd);
+            return -1;
+        }
+        close(destfd);
+        return 0;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", config_file);
+    destfd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0660);
+    if (destfd < 0) {
+        LOGE("Cannot create \"%s\": %s", tmp, strerror(errno));
+        return -1;
+    }
+    if (copy_range(srcfd, destfd, 0, line) < 0 ||
+        write(destfd, entry, n) != n ||
+        copy_range(srcfd, destfd, line + len, -1) < 0 ||
+        fsync(destfd) < 0) {
+        LOGE("Cannot write \"%s\": %s", tmp, strerror(errno));
+        close(destfd);
+        unlink(tmp);
+        return -1;
+    }
+    fchmod(destfd, 0660);
+    fchown(destfd, AID_SYSTEM, AID_WIFI);
+    close(destfd);
+
+    if (rename(tmp, config_file) < 0) {
+        LOGE("Cannot replace \"%s\": %s", config_file, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int update_ctrl_interface(const char *config_file) {
+
+    int srcfd, ret;
+    char ifc[PROPERTY_VALUE_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    struct stat sb;
+    off_t line;
+    size_t len;
+
+    if (stat(config_file, &sb) != 0)
+        return -1;
+
+    if (!strcmp(config_file, SUPP_CONFIG_FILE)) {
+        property_get("wifi.interface", ifc, WIFI_TEST_INTERFACE);
+    } else {
+        strcpy(ifc, CONTROL_IFACE_PATH);
+    }
+
+    if (conf_cache_valid(config_file, ifc, &sb))
+        return 0;
+
+    srcfd = open(config_file, O_RDONLY);
+    if (srcfd < 0) {
+        LOGE("Cannot open \"%s\": %s", config_file, strerror(errno));
+        return 0;
+    }
+
+    ret = find_ctrl_interface(srcfd, &line, &len, value, sizeof(value));
+    if (ret < 0) {
+        LOGE("Cannot read \"%s\": %s", config_file, strerror(errno));
+        close(srcfd);
+        return 0;
+    }
+
+    if (ret > 0 && strncmp(ifc, value, strlen(ifc)) != 0) {
+        LOGE("ctrl_interface != %s", ifc);
+        if (replace_ctrl_interface(config_file, srcfd, line, len, ifc) < 0) {
+            close(srcfd);
+            return -1;
+        }
+    }
+    close(srcfd);
+
+    conf_cache_store(config_file, ifc);
     return 0;
 }
 
@@ -634,6 +1224,63 @@ int ensure_config_file_exists(const char *config_file)
     return update_ctrl_interface(config_file);
 }
 
+/* A struct linux_dirent64 record as returned by getdents64. */
+struct ctrl_dirent {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * Paths of the bound UNIX sockets, one per line, from /proc/net/unix.
+ * A client socket file whose path isn't among them has no owner left.
+ */
+static char *read_bound_sockets(void)
+{
+    size_t size = 0, len = 0;
+    char *buf = NULL;
+    int fd, n;
+
+    fd = open("/proc/net/unix", O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    do {
+        if (size - len < 4096) {
+            char *p = realloc(buf, size + 16384);
+            if (p == NULL) {
+                free(buf);
+                close(fd);
+                return NULL;
+            }
+            buf = p;
+            size += 16384;
+        }
+        n = read(fd, buf + len, size - len - 1);
+        if (n > 0)
+            len += n;
+    } while (n > 0);
+    close(fd);
+    buf[len] = '\0';
+    return buf;
+}
+
+static int socket_bound(const char *bound, const char *dir, const char *name)
+{
+    size_t dirlen = strlen(dir), namelen = strlen(name);
+    const char *p = bound;
+
+    while ((p = strstr(p, name)) != NULL) {
+        if ((size_t) (p - bound) >= dirlen + 2 && p[-1] == '/' &&
+            strncmp(p - dirlen - 1, dir, dirlen) == 0 && p[-dirlen - 2] == ' ' &&
+            (p[namelen] == '\n' || p[namelen] == '\0'))
+            return 1;
+        p += namelen;
+    }
+    return 0;
+}
+
 /**
  * wifi_wpa_ctrl_cleanup() - Delete any local UNIX domain socket files that
  * may be left over from clients that were previously connected to
@@ -643,64 +1290,122 @@ int ensure_config_file_exists(const char *config_file)
  */
 void wifi_wpa_ctrl_cleanup(void)
 {
-    DIR *dir;
-    struct dirent entry;
-    struct dirent *result;
-    size_t dirnamelen;
-    size_t maxcopy;
-    char pathname[PATH_MAX];
-    char *namep;
-    char *local_socket_dir = CONFIG_CTRL_IFACE_CLIENT_DIR;
-    char *local_socket_prefix = CONFIG_CTRL_IFACE_CLIENT_PREFIX;
-
-    if ((dir = opendir(local_socket_dir)) == NULL)
+    char buf[16384];
+    char *bound = NULL;
+    const char *local_socket_dir = CONFIG_CTRL_IFACE_CLIENT_DIR;
+    const char *local_socket_prefix = CONFIG_CTRL_IFACE_CLIENT_PREFIX;
+    size_t prefixlen = strlen(local_socket_prefix);
+    int dirfd, n, pos, bound_read = 0;
+
+    dirfd = open(local_socket_dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0)
         return;
 
-    dirnamelen = (size_t)snprintf(pathname, sizeof(pathname), "%s/", local_socket_dir);
-    if (dirnamelen >= sizeof(pathname)) {
-        closedir(dir);
-        return;
-    }
-    namep = pathname + dirnamelen;
-    maxcopy = PATH_MAX - dirnamelen;
-    while (readdir_r(dir, &entry, &result) == 0 && result != NULL) {
-        if (strncmp(entry.d_name, local_socket_prefix, strlen(local_socket_prefix)) == 0) {
-            if (strlcpy(namep, entry.d_name, maxcopy) < maxcopy) {
-                unlink(pathname);
+    /* read the directory in large batches and unlink relative to it */
+    while ((n = syscall(__NR_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+        for (pos = 0; pos < n; ) {
+            struct ctrl_dirent *d = (struct ctrl_dirent *) (buf + pos);
+
+            pos += d->d_reclen;
+            if (strncmp(d->d_name, local_socket_prefix, prefixlen) != 0)
+                continue;
+            if (d->d_type != DT_SOCK && d->d_type != DT_UNKNOWN)
+                continue;
+
+            /* leave the sockets of clients that are still running */
+            if (!bound_read) {
+                bound = read_bound_sockets();
+                bound_read = 1;
             }
+            if (bound != NULL && socket_bound(bound, local_socket_dir, d->d_name))
+                continue;
+
+            unlinkat(dirfd, d->d_name, 0);
         }
     }
-    closedir(dir);
+    free(bound);
+    close(dirfd);
 }
 
-int wifi_start_supplicant_common(const char *config_file)
-{
-    char daemon_cmd[PROPERTY_VALUE_MAX];
-    char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
-    int count = 200; /* wait at most 20 seconds for completion */
 #ifdef HAVE_LIBC_SYSTEM_PROPERTIES
-    const prop_info *pi;
-    unsigned serial = 0;
-#endif
+/*
+ * Sleep until init changes the property (or, while it doesn't exist yet,
+ * any property) away from serial, or until deadline. init wakes futex
+ * waiters on both serials whenever it sets a property.
+ */
+static void property_wait(const prop_info *pi, unsigned serial,
+                          long long deadline)
+{
+    volatile unsigned *word = pi != NULL ? (volatile unsigned *) &pi->serial :
+                              (volatile unsigned *) &__system_property_area__->serial;
+    struct timespec ts;
+    long long left;
 
-    /* Check whether already running */
-    if (property_get(SUPP_PROP_NAME, supp_status, NULL)
-            && strcmp(supp_status, "running") == 0) {
-        return 0;
+    while (*word == serial && (left = deadline - now_ms()) > 0) {
+        ts.tv_sec = left / 1000;
+        ts.tv_nsec = (left % 1000) * 1000000;
+        __futex_wait(word, serial, &ts);
     }
+}
+#endif
 
-    /* Before starting the daemon, make sure its config file exists */
-    if (ensure_config_file_exists(config_file) < 0) {
-        LOGE("Wi-Fi will not be enabled");
-        return -1;
-    }
+/*
+ * Wait for the property to read value, for at most timeout_ms. If fail is
+ * given, also give up as soon as the property reads fail after having
+ * changed from start_serial, e.g. a service that started and died.
+ * Returns 0 on success, -1 otherwise.
+ */
+static int wait_for_property(const char *name, const char *value,
+                             const char *fail, unsigned start_serial,
+                             int timeout_ms)
+{
+    char current[PROPERTY_VALUE_MAX] = {'\0'};
+    long long deadline = now_ms() + timeout_ms;
+#ifdef HAVE_LIBC_SYSTEM_PROPERTIES
+    const prop_info *pi = NULL;
+    unsigned serial;
 
-    if (ensure_entropy_file_exists() < 0) {
-        LOGE("Wi-Fi entropy file was not created");
+    for (;;) {
+        if (pi == NULL)
+            pi = __system_property_find(name);
+        if (pi != NULL) {
+            serial = pi->serial;
+            __system_property_read(pi, NULL, current);
+            if (strcmp(current, value) == 0)
+                return 0;
+            if (fail != NULL && serial != start_serial &&
+                    strcmp(current, fail) == 0)
+                return -1;
+        } else {
+            serial = __system_property_area__->serial;
+        }
+        if (now_ms() >= deadline)
+            return -1;
+        property_wait(pi, serial, deadline);
     }
+#else
+    for (;;) {
+        if (property_get(name, current, NULL) && strcmp(current, value) == 0)
+            return 0;
+        if (now_ms() >= deadline)
+            return -1;
+        usleep(100000);
+    }
+#endif
+}
 
-    /* Clear out any stale socket files that might be left over. */
-    wifi_wpa_ctrl_cleanup();
+/*
+ * Start the supplicant with config_file, once everything it needs is in
+ * place.
+ */
+static int start_supplicant(const char *config_file)
+{
+    char daemon_cmd[PROPERTY_VALUE_MAX];
+    unsigned serial = 0;
+    long long start;
+#ifdef HAVE_LIBC_SYSTEM_PROPERTIES
+    const prop_info *pi;
+#endif
 
 #ifdef HAVE_LIBC_SYSTEM_PROPERTIES
     /*
@@ -717,32 +1422,263 @@ int wifi_start_supplicant_common(const char *config_file)
 #endif
     property_get("wifi.interface", iface, WIFI_TEST_INTERFACE);
     snprintf(daemon_cmd, PROPERTY_VALUE_MAX, "%s:-i%s -c%s", SUPPLICANT_NAME, iface, config_file);
+    start = now_ms();
     property_set("ctl.start", daemon_cmd);
-    sched_yield();
 
-    while (count-- > 0) {
-#ifdef HAVE_LIBC_SYSTEM_PROPERTIES
-        if (pi == NULL) {
-            pi = __system_property_find(SUPP_PROP_NAME);
-        }
-        if (pi != NULL) {
-            __system_property_read(pi, NULL, supp_status);
-            if (strcmp(supp_status, "running") == 0) {
-                return 0;
-            } else if (pi->serial != serial &&
-                    strcmp(supp_status, "stopped") == 0) {
-                return -1;
-            }
-        }
-#else
-        if (property_get(SUPP_PROP_NAME, supp_status, NULL)) {
-            if (strcmp(supp_status, "running") == 0)
-                return 0;
+    if (wait_for_property(SUPP_PROP_NAME, "running", "stopped", serial,
+                          SUPP_START_TIMEOUT_MS) < 0) {
+        LOGE("Supplicant failed to start");
+        return -1;
+    }
+    LOGI("Supplicant started in %lld ms", now_ms() - start);
+    return 0;
+}
+
+/*
+ * Bring-up. Preparing the supplicant's files and sockets doesn't depend on
+ * the driver, so when wifi_load_driver has a module to load each of those
+ * steps runs on its own thread meanwhile, and the next supplicant start
+ * joins them instead of doing the work itself. The station config is the
+ * one prepared ahead unless wifi_bring_up was asked for P2P; a start with
+ * the other config prepares its own.
+ */
+static pthread_mutex_t bringup_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the last bring-up that loaded the driver */
+static struct wifi_bringup_timeline bringup;
+/* the preparation started by the last load, until a start takes it */
+static struct wifi_bringup_timeline prep;
+static pthread_t prep_threads[WIFI_PHASE_COUNT];
+static int prep_started[WIFI_PHASE_COUNT];
+static int prep_active;
+static long long prep_start;
+static const char *prep_config;
+
+static int run_config(const char *config_file)
+{
+    return ensure_config_file_exists(config_file);
+}
+
+static int run_entropy(const char *config_file)
+{
+    return ensure_entropy_file_exists();
+}
+
+static int run_cleanup(const char *config_file)
+{
+    wifi_wpa_ctrl_cleanup();
+    return 0;
+}
+
+static int (* const bringup_steps[WIFI_PHASE_COUNT])(const char *) = {
+    [WIFI_PHASE_CONFIG] = run_config,
+    [WIFI_PHASE_ENTROPY] = run_entropy,
+    [WIFI_PHASE_CLEANUP] = run_cleanup,
+};
+
+static const char *bringup_names[WIFI_PHASE_COUNT] = {
+    [WIFI_PHASE_DRIVER] = "driver",
+    [WIFI_PHASE_CONFIG] = "config",
+    [WIFI_PHASE_ENTROPY] = "entropy",
+    [WIFI_PHASE_CLEANUP] = "cleanup",
+    [WIFI_PHASE_SUPPLICANT] = "supplicant",
+};
+
+static void timeline_init(struct wifi_bringup_timeline *timeline)
+{
+    int i;
+
+    memset(timeline, 0, sizeof(*timeline));
+    for (i = 0; i < WIFI_PHASE_COUNT; i++) {
+        timeline->phase[i].name = bringup_names[i];
+        timeline->phase[i].start_ms = timeline->phase[i].end_ms = -1;
+    }
+}
+
+static void run_step(struct wifi_phase *phase, int n, const char *config_file,
+                     long long start)
+{
+    phase->start_ms = now_ms() - start;
+    phase->result = bringup_steps[n](config_file);
+    phase->end_ms = now_ms() - start;
+}
+
+static void *run_phase(void *arg)
+{
+    struct wifi_phase *phase = arg;
+
+    run_step(phase, phase - prep.phase, prep_config, prep_start);
+    return NULL;
+}
+
+/* Called with bringup_lock held. */
+static void prep_join(void)
+{
+    int i;
+
+    for (i = 0; i < WIFI_PHASE_COUNT; i++) {
+        if (prep_started[i])
+            pthread_join(prep_threads[i], NULL);
+        prep_started[i] = 0;
+    }
+    prep_active = 0;
+}
+
+static void prep_discard(void)
+{
+    pthread_mutex_lock(&bringup_lock);
+    if (prep_active)
+        prep_join();
+    pthread_mutex_unlock(&bringup_lock);
+}
+
+static void prep_begin(const char *config_file)
+{
+    int i;
+
+    pthread_mutex_lock(&bringup_lock);
+    /* left over from a load that no supplicant start followed */
+    if (prep_active)
+        prep_join();
+    timeline_init(&prep);
+    prep_config = config_file;
+    prep_start = now_ms();
+    for (i = 0; i < WIFI_PHASE_COUNT; i++) {
+        if (!bringup_steps[i])
+            continue;
+        if (pthread_create(&prep_threads[i], NULL, run_phase, &prep.phase[i]) == 0)
+            prep_started[i] = 1;
+        else
+            run_phase(&prep.phase[i]);
+    }
+    prep.phase[WIFI_PHASE_DRIVER].start_ms = now_ms() - prep_start;
+    prep_active = 1;
+    pthread_mutex_unlock(&bringup_lock);
+}
+
+static void prep_driver_done(int result)
+{
+    struct wifi_phase *phase = &prep.phase[WIFI_PHASE_DRIVER];
+
+    pthread_mutex_lock(&bringup_lock);
+    if (prep_active) {
+        phase->result = result;
+        phase->end_ms = now_ms() - prep_start;
+        if (result < 0)
+            prep_join();
+    }
+    pthread_mutex_unlock(&bringup_lock);
+}
+
+/*
+ * Wait for the preparation started by the last driver load, if any, and
+ * take its timeline. The config step is only kept if it was for
+ * config_file. Returns 0, with an empty timeline starting now, if there
+ * was none.
+ */
+static int prep_take(const char *config_file,
+                     struct wifi_bringup_timeline *timeline, long long *start)
+{
+    int taken;
+
+    pthread_mutex_lock(&bringup_lock);
+    taken = prep_active;
+    if (taken) {
+        prep_join();
+        *timeline = prep;
+        *start = prep_start;
+        if (strcmp(prep_config, config_file) != 0) {
+            timeline->phase[WIFI_PHASE_CONFIG].start_ms = -1;
+            timeline->phase[WIFI_PHASE_CONFIG].end_ms = -1;
         }
-#endif
-        usleep(100000);
+    } else {
+        timeline_init(timeline);
+        *start = now_ms();
     }
-    return -1;
+    pthread_mutex_unlock(&bringup_lock);
+    return taken;
+}
+
+static void log_bringup(const struct wifi_bringup_timeline *timeline)
+{
+    char line[256], total[16];
+    int i, len = 0;
+
+    line[0] = '\0';
+    for (i = 0; i < WIFI_PHASE_COUNT; i++) {
+        const struct wifi_phase *p = &timeline->phase[i];
+        if (p->end_ms < 0)
+            continue;
+        len += snprintf(line + len, sizeof(line) - len, "%s %lld-%lld ms%s, ",
+                        p->name, p->start_ms, p->end_ms,
+                        p->result < 0 ? " (failed)" : "");
+        if (len >= (int) sizeof(line))
+            break;
+    }
+    LOGI("Wi-Fi bring-up: %stotal %lld ms", line, timeline->total_ms);
+
+    snprintf(total, sizeof(total), "%lld", timeline->total_ms);
+    property_set("wlan.bringup.ms", total);
+}
+
+static int load_driver_for(const char *config_file)
+{
+    int ret;
+
+    if (is_wifi_driver_loaded()) {
+        return 0;
+    }
+
+    prep_begin(config_file);
+    ret = load_driver();
+    prep_driver_done(ret);
+    return ret;
+}
+
+int wifi_start_supplicant_common(const char *config_file)
+{
+    char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
+    struct wifi_bringup_timeline timeline;
+    struct wifi_phase *phase = timeline.phase;
+    long long start;
+    int i, prepared, ret;
+
+    prepared = prep_take(config_file, &timeline, &start);
+
+    /* Check whether already running */
+    if (property_get(SUPP_PROP_NAME, supp_status, NULL)
+            && strcmp(supp_status, "running") == 0) {
+        return 0;
+    }
+
+    /*
+     * Before starting the daemon, make sure its config and entropy files
+     * exist and clear out any stale socket files that might be left over,
+     * unless that was done while the driver loaded.
+     */
+    for (i = 0; i < WIFI_PHASE_COUNT; i++) {
+        if (bringup_steps[i] && phase[i].end_ms < 0)
+            run_step(&phase[i], i, config_file, start);
+    }
+
+    if (phase[WIFI_PHASE_CONFIG].result < 0) {
+        LOGE("Wi-Fi will not be enabled");
+        ret = -1;
+    } else {
+        if (phase[WIFI_PHASE_ENTROPY].result < 0)
+            LOGE("Wi-Fi entropy file was not created");
+        phase[WIFI_PHASE_SUPPLICANT].start_ms = now_ms() - start;
+        ret = phase[WIFI_PHASE_SUPPLICANT].result = start_supplicant(config_file);
+        phase[WIFI_PHASE_SUPPLICANT].end_ms = now_ms() - start;
+    }
+
+    if (prepared) {
+        timeline.total_ms = now_ms() - start;
+        pthread_mutex_lock(&bringup_lock);
+        bringup = timeline;
+        pthread_mutex_unlock(&bringup_lock);
+        log_bringup(&timeline);
+    }
+    return ret;
 }
 
 int wifi_start_supplicant()
@@ -755,10 +1691,33 @@ int wifi_start_p2p_supplicant()
     return wifi_start_supplicant_common(P2P_CONFIG_FILE);
 }
 
+int wifi_bring_up(int p2p)
+{
+    const char *config_file = p2p ? P2P_CONFIG_FILE : SUPP_CONFIG_FILE;
+    int loaded = is_wifi_driver_loaded();
+    int ret;
+
+    ret = load_driver_for(config_file);
+    if (ret < 0)
+        return -1;
+
+    ret = wifi_start_supplicant_common(config_file);
+    /* only undo a load this call made */
+    if (ret < 0 && !loaded)
+        wifi_unload_driver();
+    return ret;
+}
+
+void wifi_get_bringup_timeline(struct wifi_bringup_timeline *timeline)
+{
+    pthread_mutex_lock(&bringup_lock);
+    *timeline = bringup;
+    pthread_mutex_unlock(&bringup_lock);
+}
+
 int wifi_stop_supplicant()
 {
     char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
-    int count = 50; /* wait at most 5 seconds for completion */
 
     /* Check whether supplicant already stopped */
     if (property_get(SUPP_PROP_NAME, supp_status, NULL)
@@ -767,18 +1726,13 @@ int wifi_stop_supplicant()
     }
 
     property_set("ctl.stop", SUPPLICANT_NAME);
-    sched_yield();
 
-    while (count-- > 0) {
-        if (property_get(SUPP_PROP_NAME, supp_status, NULL)) {
-            if (strcmp(supp_status, "stopped") == 0)
-                return 0;
-        }
-        usleep(100000);
-    }
-    return -1;
+    return wait_for_property(SUPP_PROP_NAME, "stopped", NULL, 0,
+                             SUPP_STOP_TIMEOUT_MS);
 }
 
+static int start_event_reader(void);
+
 int wifi_connect_to_supplicant()
 {
     char ifname[256];
@@ -803,6 +1757,7 @@ int wifi_connect_to_supplicant()
              ifname, strerror(errno));
         return -1;
     }
+    ctrl_stale = 0;
     monitor_conn = wpa_ctrl_open(ifname);
     if (monitor_conn == NULL) {
         wpa_ctrl_close(ctrl_conn);
@@ -823,18 +1778,132 @@ int wifi_connect_to_supplicant()
         return -1;
     }
 
+    if (start_event_reader() < 0) {
+        wpa_ctrl_close(monitor_conn);
+        wpa_ctrl_close(ctrl_conn);
+        ctrl_conn = monitor_conn = NULL;
+        close(exit_sockets[0]);
+        close(exit_sockets[1]);
+        exit_sockets[0] = exit_sockets[1] = -1;
+        return -1;
+    }
+
+    wifi_reset_command_stats();
+    return 0;
+}
+
+#define WIFI_CMD_TIMEOUT_MS     10000   /* as wpa_ctrl_request */
+/* requests in flight, below the kernel's default datagram queue of 10 */
+#define WIFI_BATCH_WINDOW       8
+#define WIFI_CMD_STATS_MAX      16
+
+static struct wifi_cmd_stats cmd_stats[WIFI_CMD_STATS_MAX];
+static int cmd_stats_used;
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Called with ctrl_lock held. */
+static void count_command(const char *cmd, long long us)
+{
+    size_t len = strcspn(cmd, " ");
+    struct wifi_cmd_stats *st;
+    int i;
+
+    if (len >= sizeof(cmd_stats[0].name))
+        len = sizeof(cmd_stats[0].name) - 1;
+    for (i = 0; i < cmd_stats_used; i++) {
+        if (strlen(cmd_stats[i].name) == len &&
+            strncmp(cmd_stats[i].name, cmd, len) == 0)
+            break;
+    }
+    if (i == cmd_stats_used) {
+        if (i == WIFI_CMD_STATS_MAX)
+            return;
+        memcpy(cmd_stats[i].name, cmd, len);
+        cmd_stats[i].name[len] = '\0';
+        cmd_stats_used++;
+    }
+
+    st = &cmd_stats[i];
+    st->count++;
+    st->total_us += us;
+    if (us > st->max_us)
+        st->max_us = us;
+}
+
+int wifi_get_command_stats(struct wifi_cmd_stats *stats, int max)
+{
+    int n;
+
+    pthread_mutex_lock(&ctrl_lock);
+    n = cmd_stats_used < max ? cmd_stats_used : max;
+    memcpy(stats, cmd_stats, n * sizeof(*stats));
+    pthread_mutex_unlock(&ctrl_lock);
+    return n;
+}
+
+void wifi_reset_command_stats(void)
+{
+    pthread_mutex_lock(&ctrl_lock);
+    memset(cmd_stats, 0, sizeof(cmd_stats));
+    cmd_stats_used = 0;
+    pthread_mutex_unlock(&ctrl_lock);
+}
+
+/*
+ * Wait for and drop the replies still owed to requests that timed out, so
+ * the next reply read is for the next request sent. Called with ctrl_lock
+ * held. Returns -2 if the supplicant is still busy with them.
+ */
+static int drain_stale_replies(int fd)
+{
+    char junk[256];
+    struct pollfd pfd;
+    int n;
+
+    while (ctrl_stale > 0) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, WIFI_CMD_TIMEOUT_MS) <= 0)
+            return -2;
+        n = recv(fd, junk, sizeof(junk), 0);
+        if (n < 0)
+            return -1;
+        /* unsolicited event, as skipped by wpa_ctrl_request */
+        if (n > 0 && junk[0] == '<')
+            continue;
+        ctrl_stale--;
+    }
     return 0;
 }
 
 int wifi_send_command(struct wpa_ctrl *ctrl, const char *cmd, char *reply, size_t *reply_len)
 {
     int ret;
+    long long start;
 
     if (ctrl_conn == NULL) {
         LOGV("Not connected to wpa_supplicant - \"%s\" command dropped.\n", cmd);
         return -1;
     }
-    ret = wpa_ctrl_request(ctrl, cmd, strlen(cmd), reply, reply_len, NULL);
+    pthread_mutex_lock(&ctrl_lock);
+    ret = drain_stale_replies(wpa_ctrl_get_fd(ctrl));
+    if (ret == 0) {
+        start = now_us();
+        ret = wpa_ctrl_request(ctrl, cmd, strlen(cmd), reply, reply_len, NULL);
+        if (ret == 0)
+            count_command(cmd, now_us() - start);
+        else if (ret == -2)
+            ctrl_stale++;
+    }
+    pthread_mutex_unlock(&ctrl_lock);
     if (ret == -2) {
         LOGD("'%s' command timed out.\n", cmd);
         /* unblocks the monitor receive socket for termination */
@@ -849,6 +1918,86 @@ int wifi_send_command(struct wpa_ctrl *ctrl, const char *cmd, char *reply, size_
     return 0;
 }
 
+/*
+ * The supplicant reads its control socket one datagram at a time and
+ * answers each before reading the next, so up to WIFI_BATCH_WINDOW
+ * requests are kept queued on the socket and the replies are matched to
+ * them in order. A command left without a reply keeps status -2, one that
+ * could not be sent gets -1. Replies still due when the batch gives up are
+ * dropped before the next command is sent.
+ */
+int wifi_command_batch(struct wifi_cmd *cmds, int count)
+{
+    long long sent_at[WIFI_BATCH_WINDOW];
+    int fd, i, n, sent = 0, done = 0;
+
+    if (ctrl_conn == NULL) {
+        LOGV("Not connected to wpa_supplicant - batch of %d dropped.\n", count);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+        cmds[i].status = -2;
+
+    pthread_mutex_lock(&ctrl_lock);
+    fd = wpa_ctrl_get_fd(ctrl_conn);
+    if (drain_stale_replies(fd) < 0) {
+        LOGD("Supplicant still busy - batch of %d dropped.\n", count);
+        pthread_mutex_unlock(&ctrl_lock);
+        return 0;
+    }
+
+    while (done < count) {
+        struct pollfd pfd;
+        struct wifi_cmd *c;
+
+        while (sent < count && sent - done < WIFI_BATCH_WINDOW) {
+            if (send(fd, cmds[sent].cmd, strlen(cmds[sent].cmd), 0) < 0) {
+                LOGD("'%s' command not sent: %s\n", cmds[sent].cmd, strerror(errno));
+                for (i = sent; i < count; i++)
+                    cmds[i].status = -1;
+                count = sent;
+                break;
+            }
+            sent_at[sent % WIFI_BATCH_WINDOW] = now_us();
+            sent++;
+        }
+        if (done == count)
+            break;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, WIFI_CMD_TIMEOUT_MS) <= 0) {
+            LOGD("'%s' command timed out.\n", cmds[done].cmd);
+            write(exit_sockets[0], "T", 1);
+            ctrl_stale += sent - done;
+            break;
+        }
+
+        c = &cmds[done];
+        n = recv(fd, c->reply, c->reply_len, 0);
+        if (n < 0) {
+            c->status = -1;
+            ctrl_stale += sent - done;
+            break;
+        }
+        /* unsolicited event, as skipped by wpa_ctrl_request */
+        if (n > 0 && c->reply[0] == '<')
+            continue;
+
+        if ((size_t) n < c->reply_len)
+            c->reply[n] = '\0';
+        c->reply_len = n;
+        c->status = strncmp(c->reply, "FAIL", 4) == 0 ? -1 : 0;
+        count_command(c->cmd, now_us() - sent_at[done % WIFI_BATCH_WINDOW]);
+        done++;
+    }
+    pthread_mutex_unlock(&ctrl_lock);
+
+    return done;
+}
+
 int wifi_ctrl_recv(struct wpa_ctrl *ctrl, char *reply, size_t *reply_len)
 {
     int res;
@@ -874,62 +2023,242 @@ int wifi_ctrl_recv(struct wpa_ctrl *ctrl, char *reply, size_t *reply_len)
     return 0;
 }
 
-int wifi_wait_for_event(char *buf, size_t buflen)
+/* slots in the event queue; one is kept for the final TERMINATING event */
+#define WIFI_EVENT_QUEUE        32
+
+static const struct {
+    const char *name;           /* a trailing '-' matches as a prefix */
+    int type;
+} event_names[] = {
+    { "CTRL-EVENT-BSS-ADDED",       WIFI_EVENT_BSS_ADDED },
+    { "CTRL-EVENT-BSS-REMOVED",     WIFI_EVENT_BSS_REMOVED },
+    { "CTRL-EVENT-SCAN-RESULTS",    WIFI_EVENT_SCAN_RESULTS },
+    { "CTRL-EVENT-STATE-CHANGE",    WIFI_EVENT_STATE_CHANGE },
+    { "CTRL-EVENT-CONNECTED",       WIFI_EVENT_CONNECTED },
+    { "CTRL-EVENT-DISCONNECTED",    WIFI_EVENT_DISCONNECTED },
+    { "CTRL-EVENT-TERMINATING",     WIFI_EVENT_TERMINATING },
+    { "CTRL-EVENT-DRIVER-STATE",    WIFI_EVENT_DRIVER_STATE },
+    { "CTRL-EVENT-EAP-FAILURE",     WIFI_EVENT_EAP_FAILURE },
+    { "CTRL-EVENT-ASSOC-REJECT",    WIFI_EVENT_ASSOC_REJECT },
+    { "CTRL-EVENT-LINK-SPEED",      WIFI_EVENT_LINK_SPEED },
+    { "AP-STA-CONNECTED",           WIFI_EVENT_AP_STA_CONNECTED },
+    { "AP-STA-DISCONNECTED",        WIFI_EVENT_AP_STA_DISCONNECTED },
+    { "WPS-",                       WIFI_EVENT_WPS },
+    { "P2P-",                       WIFI_EVENT_P2P },
+};
+
+/*
+ * event_queue[event_head] up to event_tail (both counting up, used modulo
+ * the queue size) hold received events. The reader thread fills the slot
+ * at event_tail before publishing it, and the consumer holds the slot at
+ * event_head from wifi_get_event to wifi_put_event.
+ */
+static struct wifi_event event_queue[WIFI_EVENT_QUEUE];
+static struct wifi_event closed_event;
+static unsigned event_head, event_tail, event_dropped;
+static int event_running, event_stop;
+static pthread_t event_thread;
+static int event_thread_started;
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t event_space = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Events strings are in the format
+ *
+ *     <N>CTRL-EVENT-XXX
+ *
+ * where N is the message level in numerical form (0=VERBOSE, 1=DEBUG,
+ * etc.) and XXX is the event name. Record where each part starts rather
+ * than moving the text.
+ */
+static void event_parse(struct wifi_event *ev, size_t len)
 {
-    size_t nread = buflen - 1;
-    int fd;
-    fd_set rfds;
-    int result;
-    struct timeval tval;
-    struct timeval *tptr;
+    const char *name;
+    size_t name_len, i;
+
+    ev->buf[len] = '\0';
+    ev->len = len;
+    ev->level = -1;
+    ev->name = 0;
+    if (ev->buf[0] == '<') {
+        char *match = strchr(ev->buf, '>');
+        if (match != NULL) {
+            ev->level = atoi(ev->buf + 1);
+            ev->name = match + 1 - ev->buf;
+        }
+    }
 
-    if (monitor_conn == NULL) {
-        LOGD("Connection closed\n");
-        strncpy(buf, WPA_EVENT_TERMINATING " - connection closed", buflen-1);
-        buf[buflen-1] = '\0';
-        return strlen(buf);
-    }
-
-    result = wifi_ctrl_recv(monitor_conn, buf, &nread);
-    if (result < 0) {
-        LOGD("wifi_ctrl_recv failed: %s\n", strerror(errno));
-        strncpy(buf, WPA_EVENT_TERMINATING " - recv error", buflen-1);
-        buf[buflen-1] = '\0';
-        return strlen(buf);
-    }
-    buf[nread] = '\0';
-    /* LOGD("wait_for_event: result=%d nread=%d string=\"%s\"\n", result, nread, buf); */
-    /* Check for EOF on the socket */
-    if (result == 0 && nread == 0) {
-        /* Fabricate an event to pass up */
-        LOGD("Received EOF on supplicant socket\n");
-        strncpy(buf, WPA_EVENT_TERMINATING " - signal 0 received", buflen-1);
-        buf[buflen-1] = '\0';
-        return strlen(buf);
+    name = ev->buf + ev->name;
+    name_len = strcspn(name, " ");
+    ev->payload = ev->name + name_len;
+    if (ev->buf[ev->payload] == ' ')
+        ev->payload++;
+
+    ev->type = WIFI_EVENT_UNKNOWN;
+    for (i = 0; i < sizeof(event_names) / sizeof(event_names[0]); i++) {
+        const char *n = event_names[i].name;
+        size_t len = strlen(n);
+        if ((len == name_len || n[len - 1] == '-') && strncmp(name, n, len) == 0) {
+            ev->type = event_names[i].type;
+            break;
+        }
     }
-    /*
-     * Events strings are in the format
-     *
-     *     <N>CTRL-EVENT-XXX 
-     *
-     * where N is the message level in numerical form (0=VERBOSE, 1=DEBUG,
-     * etc.) and XXX is the event name. The level information is not useful
-     * to us, so strip it off.
-     */
-    if (buf[0] == '<') {
-        char *match = strchr(buf, '>');
-        if (match != NULL) {
-            nread -= (match+1-buf);
-            memmove(buf, match+1, nread+1);
+}
+
+static void event_set(struct wifi_event *ev, const char *text)
+{
+    strlcpy(ev->buf, text, sizeof(ev->buf));
+    event_parse(ev, strlen(ev->buf));
+}
+
+/* Scan bursts of these can be dropped; SCAN-RESULTS follows them anyway. */
+static int event_droppable(const struct wifi_event *ev)
+{
+    return ev->type == WIFI_EVENT_BSS_ADDED || ev->type == WIFI_EVENT_BSS_REMOVED;
+}
+
+static void *event_reader(void *arg)
+{
+    struct wpa_ctrl *monitor = arg;
+    int last = 0;
+
+    while (!last) {
+        struct wifi_event *ev;
+        size_t nread = sizeof(ev->buf) - 1;
+        int result;
+
+        pthread_mutex_lock(&event_lock);
+        while (event_tail - event_head >= WIFI_EVENT_QUEUE - 1 && !event_stop)
+            pthread_cond_wait(&event_space, &event_lock);
+        last = event_stop;
+        ev = &event_queue[event_tail % WIFI_EVENT_QUEUE];
+        pthread_mutex_unlock(&event_lock);
+
+        /* the slot at the tail is ours until it is published */
+        result = last ? -1 : wifi_ctrl_recv(monitor, ev->buf, &nread);
+        if (result < 0) {
+            LOGD("wifi_ctrl_recv failed: %s\n", strerror(errno));
+            event_set(ev, WPA_EVENT_TERMINATING " - recv error");
+            last = 1;
+        } else if (nread == 0) {
+            /* Fabricate an event to pass up */
+            LOGD("Received EOF on supplicant socket\n");
+            event_set(ev, WPA_EVENT_TERMINATING " - signal 0 received");
+            last = 1;
+        } else {
+            event_parse(ev, nread);
+        }
+
+        pthread_mutex_lock(&event_lock);
+        if (!last && event_droppable(ev) &&
+            event_tail - event_head >= WIFI_EVENT_QUEUE / 2) {
+            event_dropped++;
+        } else {
+            event_tail++;
+            pthread_cond_signal(&event_ready);
         }
+        if (last) {
+            event_running = 0;
+            pthread_cond_broadcast(&event_ready);
+        }
+        pthread_mutex_unlock(&event_lock);
+    }
+
+    return NULL;
+}
+
+static int start_event_reader(void)
+{
+    pthread_mutex_lock(&event_lock);
+    event_head = event_tail = event_dropped = 0;
+    event_stop = 0;
+    event_running = 1;
+    pthread_mutex_unlock(&event_lock);
+
+    if (pthread_create(&event_thread, NULL, event_reader, monitor_conn) != 0) {
+        LOGE("Cannot start the supplicant event thread: %s", strerror(errno));
+        event_running = 0;
+        return -1;
     }
-    return nread;
+    event_thread_started = 1;
+    return 0;
+}
+
+static void stop_event_reader(void)
+{
+    if (!event_thread_started)
+        return;
+
+    pthread_mutex_lock(&event_lock);
+    event_stop = 1;
+    pthread_cond_broadcast(&event_space);
+    pthread_mutex_unlock(&event_lock);
+
+    /* wakes the reader if it is waiting on the monitor socket */
+    write(exit_sockets[0], "T", 1);
+    pthread_join(event_thread, NULL);
+    event_thread_started = 0;
+}
+
+const struct wifi_event *wifi_get_event(void)
+{
+    const struct wifi_event *ev;
+
+    pthread_mutex_lock(&event_lock);
+    while (event_head == event_tail && event_running)
+        pthread_cond_wait(&event_ready, &event_lock);
+    if (event_head == event_tail) {
+        pthread_mutex_unlock(&event_lock);
+        LOGD("Connection closed\n");
+        event_set(&closed_event, WPA_EVENT_TERMINATING " - connection closed");
+        return &closed_event;
+    }
+    ev = &event_queue[event_head % WIFI_EVENT_QUEUE];
+    pthread_mutex_unlock(&event_lock);
+
+    return ev;
+}
+
+void wifi_put_event(const struct wifi_event *ev)
+{
+    if (ev == &closed_event)
+        return;
+
+    pthread_mutex_lock(&event_lock);
+    event_head++;
+    pthread_cond_signal(&event_space);
+    pthread_mutex_unlock(&event_lock);
+}
+
+unsigned wifi_get_dropped_events(void)
+{
+    unsigned dropped;
+
+    pthread_mutex_lock(&event_lock);
+    dropped = event_dropped;
+    pthread_mutex_unlock(&event_lock);
+    return dropped;
+}
+
+int wifi_wait_for_event(char *buf, size_t buflen)
+{
+    const struct wifi_event *ev = wifi_get_event();
+    size_t len = ev->len - ev->name;
+
+    /* the level information is not useful to us, so leave it off */
+    if (len > buflen - 1)
+        len = buflen - 1;
+    memcpy(buf, ev->buf + ev->name, len);
+    buf[len] = '\0';
+    wifi_put_event(ev);
+
+    return len;
 }
 
 void wifi_close_supplicant_connection()
 {
-    char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
-    int count = 50; /* wait at most 5 seconds to ensure init has stopped stupplicant */
+    stop_event_reader();
 
     if (ctrl_conn != NULL) {
         wpa_ctrl_close(ctrl_conn);
@@ -950,13 +2279,8 @@ void wifi_close_supplicant_connection()
         exit_sockets[1] = -1;
     }
 
-    while (count-- > 0) {
-        if (property_get(SUPP_PROP_NAME, supp_status, NULL)) {
-            if (strcmp(supp_status, "stopped") == 0)
-                return;
-        }
-        usleep(100000);
-    }
+    /* wait at most 5 seconds to ensure init has stopped supplicant */
+    wait_for_property(SUPP_PROP_NAME, "stopped", NULL, 0, SUPP_STOP_TIMEOUT_MS);
 }
 
 int wifi_command(const char *command, char *reply, size_t *reply_len)
@@ -979,12 +2303,14 @@ const char *wifi_get_fw_path(int fw_type)
 
 int wifi_change_fw_path(const char *fwpath)
 {
-    int len;
-    int fd;
-    int ret = 0;
+    int ret;
+#ifdef WIFI_DRIVER_KEEP_LOADED
+    long long start = now_ms();
+    int was_up;
+#endif
 
     if (!fwpath)
-        return ret;
+        return 0;
 
     if (!is_wifi_driver_loaded()) {
         LOGD("Loading wifi driver so that we may set the fw path");
@@ -993,16 +2319,20 @@ int wifi_change_fw_path(const char *fwpath)
         }
     }
 
-    fd = open(WIFI_DRIVER_FW_PATH_PARAM, O_WRONLY);
-    if (fd < 0) {
-        LOGE("Failed to open wlan fw path param (%s)", strerror(errno));
-        return -1;
-    }
-    len = strlen(fwpath) + 1;
-    if (write(fd, fwpath, len) != len) {
-        LOGE("Failed to write wlan fw path param (%s)", strerror(errno));
+#ifdef WIFI_DRIVER_KEEP_LOADED
+    /* the new firmware is downloaded when the interface next comes up */
+    was_up = iface_is_up();
+    if (was_up)
+        set_iface_up(0);
+#endif
+    ret = write_fw_path(fwpath);
+#ifdef WIFI_DRIVER_KEEP_LOADED
+    if (was_up && set_iface_up(1) < 0) {
+        LOGE("Failed to bring up wlan after changing fw path");
         ret = -1;
     }
-    close(fd);
+    if (ret == 0)
+        LOGI("Wi-Fi firmware switched to %s in %lld ms", fwpath, now_ms() - start);
+#endif
     return ret;
 }
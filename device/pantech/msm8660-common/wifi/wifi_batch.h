@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WIFI_BATCH_H
+#define _WIFI_BATCH_H
+
+#include <stddef.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct wifi_cmd {
+    const char *cmd;
+    char *reply;
+    size_t reply_len;           /* in: size of reply, out: bytes received */
+    int status;                 /* as returned by wifi_command */
+};
+
+/**
+ * Send a run of commands to the supplicant without waiting for each reply
+ * before sending the next. The supplicant answers its control socket in
+ * order, so replies are matched to commands by position.
+ *
+ * This header is not exported with hardware_legacy/wifi.h and nothing in
+ * this tree calls wifi_command_batch; the framework still sends its
+ * commands one at a time through wifi_command, which the latency counters
+ * below do cover.
+ *
+ * @param cmds commands to send, with their reply buffers
+ * @param count number of commands
+ * @return the number of commands that got a reply, or -1 if not
+ *         connected. Each command's own result is left in its status.
+ */
+int wifi_command_batch(struct wifi_cmd *cmds, int count);
+
+struct wifi_cmd_stats {
+    char name[32];              /* first word of the command */
+    unsigned count;
+    unsigned long long total_us;
+    unsigned max_us;
+};
+
+/**
+ * Round-trip latency per command name since the supplicant connection was
+ * opened or the counters were reset. A batched command is timed from when
+ * it was sent.
+ *
+ * @param stats array to fill
+ * @param max size of stats
+ * @return the number of entries filled in
+ */
+int wifi_get_command_stats(struct wifi_cmd_stats *stats, int max);
+void wifi_reset_command_stats(void);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _WIFI_BATCH_H
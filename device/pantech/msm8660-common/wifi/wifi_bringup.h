@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WIFI_BRINGUP_H
+#define _WIFI_BRINGUP_H
+
+#if __cplusplus
+extern "C" {
+#endif
+
+enum {
+    WIFI_PHASE_DRIVER,
+    WIFI_PHASE_CONFIG,
+    WIFI_PHASE_ENTROPY,
+    WIFI_PHASE_CLEANUP,
+    WIFI_PHASE_SUPPLICANT,
+    WIFI_PHASE_COUNT
+};
+
+struct wifi_phase {
+    const char *name;
+    long long start_ms;         /* from the start of the bring-up, -1 if not run */
+    long long end_ms;
+    int result;
+};
+
+struct wifi_bringup_timeline {
+    struct wifi_phase phase[WIFI_PHASE_COUNT];
+    long long total_ms;
+};
+
+/**
+ * Load the driver and start the supplicant, as wifi_load_driver followed
+ * by wifi_start_supplicant or wifi_start_p2p_supplicant do. When the
+ * driver has to be loaded, its config and entropy files are prepared and
+ * stale control sockets cleaned out on worker threads meanwhile, and the
+ * total time is logged and published in wlan.bringup.ms. The framework
+ * gets the same overlap and property through those calls. This header is
+ * not exported with hardware_legacy/wifi.h and nothing in this tree calls
+ * wifi_bring_up or wifi_get_bringup_timeline; they are only for code built
+ * against this directory.
+ *
+ * @param p2p nonzero to start the supplicant with the P2P config
+ * @return 0 on success, -1 on failure, with the driver unloaded again if
+ *         this call loaded it
+ */
+int wifi_bring_up(int p2p);
+
+/**
+ * Phase timings of the last bring-up that loaded the driver, through
+ * either path.
+ */
+void wifi_get_bringup_timeline(struct wifi_bringup_timeline *timeline);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _WIFI_BRINGUP_H
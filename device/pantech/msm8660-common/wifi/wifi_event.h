@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WIFI_EVENT_H
+#define _WIFI_EVENT_H
+
+#include <stddef.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+#define WIFI_EVENT_BUF 2048
+
+enum wifi_event_type {
+    WIFI_EVENT_UNKNOWN = 0,
+    WIFI_EVENT_CONNECTED,
+    WIFI_EVENT_DISCONNECTED,
+    WIFI_EVENT_STATE_CHANGE,
+    WIFI_EVENT_SCAN_RESULTS,
+    WIFI_EVENT_BSS_ADDED,
+    WIFI_EVENT_BSS_REMOVED,
+    WIFI_EVENT_TERMINATING,
+    WIFI_EVENT_DRIVER_STATE,
+    WIFI_EVENT_EAP_FAILURE,
+    WIFI_EVENT_ASSOC_REJECT,
+    WIFI_EVENT_LINK_SPEED,
+    WIFI_EVENT_AP_STA_CONNECTED,
+    WIFI_EVENT_AP_STA_DISCONNECTED,
+    WIFI_EVENT_WPS,             /* any WPS-* event */
+    WIFI_EVENT_P2P,             /* any P2P-* event */
+};
+
+/*
+ * A supplicant event as received, e.g. "<3>CTRL-EVENT-BSS-ADDED 4 ...".
+ * The offsets index buf, which is NUL terminated at len.
+ */
+struct wifi_event {
+    int type;                   /* enum wifi_event_type */
+    int level;                  /* the <N> message level, -1 if absent */
+    size_t name;                /* start of the event name */
+    size_t payload;             /* text after the name and one space */
+    size_t len;
+    char buf[WIFI_EVENT_BUF];
+};
+
+/**
+ * Wait for the next event from the supplicant. Events are read off the
+ * monitor socket into a bounded queue by a thread started with the
+ * connection, so a caller that falls behind doesn't stall the socket.
+ * Only one thread may take events at a time.
+ *
+ * wifi_wait_for_event takes its events from the same queue. This header
+ * is not exported with hardware_legacy/wifi.h, so the parsed form is only
+ * for code built against this directory; nothing in this tree uses it.
+ *
+ * @return the event, valid until wifi_put_event. When the connection is
+ *         gone a WIFI_EVENT_TERMINATING event is returned.
+ */
+const struct wifi_event *wifi_get_event(void);
+
+/**
+ * Give an event from wifi_get_event back to the queue.
+ */
+void wifi_put_event(const struct wifi_event *event);
+
+/**
+ * Number of BSS-ADDED and BSS-REMOVED events dropped because the queue was
+ * more than half full, since the connection was opened.
+ */
+unsigned wifi_get_dropped_events(void);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _WIFI_EVENT_H